@@ -9,6 +9,7 @@
 #include <CanvasPoint.h>
 #include <Colour.h>
 #include <cstring>
+#include <cstdlib>
 #include <map>
 #include <iostream>
 #include <string>
@@ -16,10 +17,27 @@
 #include <math.h>
 #include <cmath>
 #include <RayTriangleIntersection.h>
-#include <list>
+#include <BVH.h>
+#include <TriangleStore.h>
+#include <InstancedScene.h>
+#include <SceneView.h>
+#include <TileScheduler.h>
+#include <RayPacket.h>
+#include <RayQueue.h>
+#include <Wavefront.h>
+#include <LightSampler.h>
+#include <Random.h>
+#include <Denoiser.h>
+#include <Material.h>
+#include <GBuffer.h>
+#include <VisibilityBuffer.h>
+#include <Lightmap.h>
+#include <ShadowMap.h>
+#include <RasterTriangle.h>
 #include <glm/ext.hpp>
 #include <glm/gtx/rotate_vector.hpp>
 #include <random>
+#include <chrono>
 
 //Global definitions
 #define WIDTH  900
@@ -30,13 +48,33 @@
 typedef enum { RIGHT, LEFT, FORWARD, BACKWARD, UP, DOWN } Direction;
 //Raytracing definitions
 #define NUM_LIGHT_RAYS 1
-#define GLASS_INDEX_OF_REFRACTION 1.512f
+#define LIGHT_SIZE 0.11f
+#define LIGHT_SAMPLE_SEED 1
 #define GLASS_MAGIC_NUMBER 1.15f
 #define SOBEL_THRESHOLD 0.5
+#define EDGE_MASK_WORDS ((WIDTH + 63) / 64)
+#define EDGE_BATCH_SIZE 64
+#define NUM_THREADS 0
+#define TILE_SIZE 16
+#define PREVIEW_COARSEST_STEP 8
+#define LIGHT_STEP 0.25f
+#define DIRECT_POWER_STEP 5.f
+#define INDIRECT_POWER_STEP 0.05f
+#define BAKE_LIGHT_SAMPLES 16
+#define BAKE_BOUNCE_RAYS 64
+#define CROWD_SIZE 24
+#define ANIMATION_SPEED 0.1f
+#define SECONDARY_BATCH_SIZE 256
+#define MAX_BOUNCE_DEPTH 32
+#define MIN_THROUGHPUT 0.01f
+//Path tracing definitions
+#define ROULETTE_DEPTH 3
+#define DISPLAY_GAMMA 2.2f
 //Rasterising definitions
 #define EDGE_THRESHOLD_MIN 0.0312
 #define EDGE_THRESHOLD_MAX 0.125
 #define SUBPIXEL_QUALITY 0.75
+#define RASTER_TILE_SIZE 64
 
 //Main functions
 void draw();
@@ -44,37 +82,87 @@ void update(SDL_Event event);
 void handleEvent(SDL_Event event);
 void drawWireframe(CanvasTriangle triangle,Colour colour);
 //Raytracing functions
-void rayTracing(std::vector<ModelTriangle> triangles);
+void rayTracing(const SceneView& scene);
+bool refineProgressively(SDL_Event& event);
+void tracePreview(const SceneView& scene, int step);
 void GenAreaLight();
-glm::vec3 traceRayFromCamera(float x, float y,std::vector<ModelTriangle> modelTriangles);
-RayTriangleIntersection getClosestIntersection(std::vector<ModelTriangle> triangles,  glm::vec3 rayDirection,glm::vec3 start );
+glm::vec3 getLightPosition(int pixel, int sample);
+void accumulatePass();
+glm::vec3 traceRayFromCamera(float x, float y, const SceneView& scene, RayQueue* deferred = NULL, bool primaryPass = false);
+void tracePacketFromCamera(const float* xs, const float* ys, int count, const SceneView& scene, glm::vec3* colours, RayQueue* deferred = NULL, bool primaryPass = false);
+void recordPrimaryHit(const RayTriangleIntersection& hit, const SurfaceHit& surface, glm::vec3 direction, int pixel);
+void shadeGBuffer(const SceneView& scene);
+void hybridTracing(const SceneView& scene);
+void rasteriseVisibility(const SceneView& scene);
+RayTriangleIntersection visibleHit(const SceneView& scene, int pixel, glm::vec3 rayDirection);
+glm::vec3 shadeCameraHit(const RayTriangleIntersection& closestinter, const SurfaceHit& surface, glm::vec3 dir, const SceneView& scene, int pixel, RayQueue* deferred = NULL);
+void traceSecondaryRays(RayQueue& queue, const SceneView& scene);
+void recordGuide(const RayTriangleIntersection& hit, const SurfaceHit& surface, glm::vec3 direction, int pixel);
+void denoiseFrame();
+void resolveQueuedRay(const QueuedRay& ray, const RayTriangleIntersection& hit, const SceneView& scene, std::vector<QueuedRay>& continued);
+bool bounceRay(const RayTriangleIntersection& input, const SurfaceHit& surface, glm::vec3 rayDir, glm::vec3& origin, glm::vec3& direction, bool& glass);
+ShadowRay lightSample(const RayTriangleIntersection& input, const SurfaceHit& surface, glm::vec3 rayDir, glm::vec3 light);
+void wavefrontTracing(const SceneView& scene);
+void intersectWavefront(const RayQueue& rays, const SceneView& scene, std::vector<RayTriangleIntersection>& hits);
+void shadeWavefrontHit(const QueuedRay& ray, const RayTriangleIntersection& hit, const SceneView& scene, std::vector<QueuedRay>& continued, std::vector<ShadedHit>& shaded, std::vector<ShadowRay>& shadowRays);
+void getClosestPacketIntersection(const SceneView& scene, RayPacket& packet);
+void intersectPacketMesh(const Mesh& mesh, RayPacket& packet);
+void benchmarkIntersectionKernels(const SceneView& scene);
+RayTriangleIntersection getClosestIntersection(const SceneView& scene, glm::vec3 rayDirection, glm::vec3 start);
+bool isOccluded(const SceneView& scene, glm::vec3 origin, glm::vec3 dir, float maxDist);
 glm::vec3 intersection(ModelTriangle triangle, glm::vec3 rayDirection, glm::vec3 start);
-Colour directLight(RayTriangleIntersection input, std::vector<ModelTriangle> modelTriangles, glm::vec3 direction);
+RayTriangleIntersection makeIntersection(const SceneView& scene, int instance, int slot, float t, float u, float v);
+SurfaceHit resolveHit(const SceneView& scene, const RayTriangleIntersection& hit);
+std::vector<int> getMaterialIndices(const std::vector<ModelTriangle>& triangles);
+void buildInstancedScene(const std::vector<ModelTriangle>& box, const std::vector<ModelTriangle>& sphere, const std::vector<ModelTriangle>& logo);
+void toggleCrowd();
+void toggleObjectAnimation();
+void animateScene();
+Colour directLight(const RayTriangleIntersection& input, const SurfaceHit& surface, const SceneView& scene, glm::vec3 direction, int pixel);
+Colour shadeSurface(const RayTriangleIntersection& input, const SurfaceHit& surface, const SceneView& scene, glm::vec3 rayDir, int pixel);
 glm::vec3 getReflectedDirection(const glm::vec3& incident, const glm::vec3& normal);
+float surfaceReflectance(const SurfaceHit& surface);
+//Path tracing functions
+void pathTracing(const SceneView& scene);
+void findEmitters(const SceneView& scene);
+glm::vec3 tracePath(const SceneView& scene, glm::vec3 origin, glm::vec3 direction, Random& random, int pixel);
+glm::vec3 sampleEmitter(const SceneView& scene, glm::vec3 point, glm::vec3 normal, Random& random);
+float emitterPdf(glm::vec3 origin, glm::vec3 lightPoint, glm::vec3 lightNormal);
+glm::vec3 emitterNormal(const SceneView& scene, int instance, glm::vec3 triangleNormal, glm::vec3 vertex);
+glm::vec3 sampleGlass(glm::vec3 direction, glm::vec3 normal, float refractiveIndex, Random& random);
+glm::vec3 cosineDirection(glm::vec3 normal, float u1, float u2);
+float powerHeuristic(float pdf, float otherPdf);
 //Supersampling functions
-void antiAliasing(std::vector<ModelTriangle> triangles) ;
-void computePixelsIntensity();
+void antiAliasing(const SceneView& scene);
+void computePixelsIntensity(int y);
+void sobelRow(int y);
 float sobelOperator(int x, int y);
-glm::vec3 supersamplingAA(int x, int y, std::vector<ModelTriangle> modelTriangles);
+glm::vec3 supersamplingAA(int x, int y, const SceneView& scene);
 //Rasteriser functions
 void initDepthBuffer();
-std::vector<CanvasTriangle> convertModelToCanvas(std::vector<ModelTriangle> triangles);
+std::vector<CanvasTriangle> convertModelToCanvas(const SceneView& scene);
 CanvasPoint convertModelVertexToCanvasPoint(glm::vec3 modelVertex, glm::vec3 normal);
 void rasterisation(CanvasTriangle triangle,Colour colour, bool texture);
+RasterTriangle setupTriangle(const CanvasTriangle& triangle, Colour colour, bool texture);
+void rasteriseRegion(const RasterTriangle& triangle, int x0, int y0, int x1, int y1);
+void rasteriseTiled(const std::vector<CanvasTriangle>& triangles, const std::vector<CanvasTriangle>& logo);
 void drawLine(CanvasPoint from, CanvasPoint to, Colour colour);
+void drawPixel(int x, int y, float z, float brightness, float xt, float yt, float zInv, glm::vec2 lightmapPoint, const RasterShading& shading);
+void renderShadowMap(const SceneView& scene);
+void bakeLightmap(const SceneView& scene);
+glm::vec3 bakeTexel(const SceneView& scene, glm::vec3 point, glm::vec3 normal, Random& random);
+glm::vec3 bakeLightPosition(float u, float v);
 std::vector<CanvasPoint> interpolate(CanvasPoint from, CanvasPoint to);
-CanvasPoint calculateExtra(CanvasTriangle triangle);
-void fillTriangle(CanvasPoint v1, CanvasPoint v2, CanvasPoint v3, Colour colour);
 //FXAA functions
 void applyAntiAliasing();
 float rgb2luma(glm::vec3 rgb);
 //Utilities
 std::map<std::string, Colour> loadMaterials(std::string img);
 void loadTriangles (std::string imgName, std::map<std::string, Colour> m);
-void loadSphere(std::string imgName, std::map<std::string, Colour> materials);
+std::vector<ModelTriangle> loadSphere(std::string imgName, std::map<std::string, Colour> materials);
 std::vector<ModelTriangle> loadLogo (std::string imgName);
 std::vector<ModelTriangle> calculateNormals(std::vector<ModelTriangle> triangles);
-glm::vec3 calculateVertexNormal(std::vector<ModelTriangle> modelTriangles, glm::vec3 modelVertex);
+glm::vec3 calculateVertexNormal(const std::vector<ModelTriangle>& modelTriangles, glm::vec3 modelVertex);
 bool compareVectors(glm::vec3 v1, glm::vec3 v2);
 std::vector<std::vector<uint32_t>> loadPPM(std::string imgName);
 void saveImage();
@@ -108,59 +196,142 @@ bool animation = 0;
 
 std::vector<ModelTriangle> modelTriangles;
 std::map<std::string, Colour> materials;
+MaterialTable materialTable;
 std::vector<ModelTriangle> logoTriangles;
 //Raytracing variables
-std::vector<glm::vec3> lightPositionArr(NUM_LIGHT_RAYS);
+LightSampler lightSampler;
+int lightSamples = NUM_LIGHT_RAYS;
+glm::vec2 lightFrameOffset;
+glm::vec3 accumulationBuffer[WIDTH][HEIGHT];
+int accumulatedPasses = 0;
+bool progressive = 0;
+bool previewRefinement = 1;
+InstancedScene sceneInstances;
+int baseInstances = 0;
+bool showCrowd = 0;
+int sphereMesh;
+int logoMesh;
+glm::mat4 logoTransform;
+//Object animation variables
+bool animateObjects = 0;
+int animationFrame = 0;
+int logoInstance = -1;
+std::vector<ModelTriangle> sphereRest;
+bool useBVH = 1;
+bool useWideBVH = 1;
+bool usePacketTracing = 1;
+bool batchSecondaryRays = 0;
+bool useWavefront = 0;
+bool useHybrid = 0;
+int maxBounceDepth = MAX_BOUNCE_DEPTH;
+thread_local int bounceDepth = 0;
+//Path tracing variables
+std::vector<ModelTriangle> emitters;
+//Area of the emitters up to and including each one, the last is the total
+std::vector<float> emitterAreas;
+float emitterArea = 0;
 
 glm::vec3 INTENSITY_WEIGHTS(0.2989, 0.5870, 0.1140);
 float screenPixelsIntensity[HEIGHT][WIDTH];
-std::list<std::pair<int, int>>* aliasedEdges = new std::list<std::pair<int, int>>();
-bool isMirror = 0;
+uint64_t edgeMask[HEIGHT][EDGE_MASK_WORDS];
+std::vector<std::pair<int, int>> aliasedEdges;
+bool edgeSupersampling = 0;
+thread_local bool isMirror = 0;
+TileScheduler* scheduler;
+Denoiser* denoiser;
+bool denoise = 0;
+GBuffer* gBuffer;
+VisibilityBuffer* visibility;
 //Rasterising variables
 float depthBuffer[WIDTH][HEIGHT];
 float quality[12] = {1, 1, 1, 1, 1, 1.5, 2.0, 2.0, 2.0, 2.0, 4.0, 8.0};
-bool isTexture = 0;
+bool tiledRasterisation = 1;
 std::vector<std::vector<uint32_t>> ppmtex;
 bool isLogo = 0;
+//Baked lighting variables
+Lightmap* lightmap;
+bool bakedLighting = 0;
+//Shadow mapping variables
+ShadowMap* shadowMap;
+bool shadowMapping = 0;
+bool shadowFiltering = 1;
 float textureHeight;
 float textureWidth;
 ////Start program
 //////////////////////////////////////////////////////////////////////////////////////////////////
 int main(int argc, char* argv[]) {
 
+  //Number of render threads, 0 uses every core
+  int threads = NUM_THREADS;
+  if(argc > 1) {
+    char* end;
+    long requested = strtol(argv[1], &end, 10);
+    //CASE: Thread count is not a number
+    if(end == argv[1] || *end != '\0')
+      std::cout<<"Usage: "<<argv[0]<<" [threads], using every core"<<std::endl;
+    else
+      threads = (int) requested;
+  }
+  if(threads <= 0)
+    threads = std::thread::hardware_concurrency();
+  scheduler = new TileScheduler(threads);
+  denoiser = new Denoiser(WIDTH, HEIGHT);
+  gBuffer = new GBuffer(WIDTH * HEIGHT);
+  visibility = new VisibilityBuffer(WIDTH, HEIGHT, focalLength);
+  lightmap = new Lightmap();
+  shadowMap = new ShadowMap(SHADOW_MAP_SIZE);
+
   RotationY[1][1] = 1;
   RotationX[0][0] = 1;
   UpdateYRotationMatrix();
   UpdateXRotationMatrix();
 
+  lightSampler.build(lightSamples, LIGHT_SAMPLE_SEED);
   materials = loadMaterials("cornell-box/cornell-box.mtl");
   loadTriangles("cornell-box/cornell-box.obj",materials);
-  loadSphere("lowres-sphere.obj",materials);
-  modelTriangles = calculateNormals(modelTriangles);
+  std::vector<ModelTriangle> box = calculateNormals(modelTriangles);
+  std::vector<ModelTriangle> sphere = calculateNormals(loadSphere("lowres-sphere.obj",materials));
   isLogo = 1;
-  logoTriangles = loadLogo("hackspace-logo/logo.obj");
-  logoTriangles = calculateNormals(logoTriangles);
+  std::vector<ModelTriangle> logo = calculateNormals(loadLogo("hackspace-logo/logo.obj"));
+  buildInstancedScene(box, sphere, logo);
   ppmtex = loadPPM("hackspace-logo/texture.ppm");
 
   SDL_Event event;
+  //A key pressed while a preview was refining, still to be handled
+  bool interrupted = false;
   draw();
   window.renderFrame();
   while(true)
   {
-    if(animation){
-      cameraPos += GetAxis(Direction::BACKWARD);
-      cameraPos += GetAxis(Direction::LEFT);
+    if(animation || (animateObjects && mode >= 3)){
+      if(animation) {
+        cameraPos += GetAxis(Direction::BACKWARD);
+        cameraPos += GetAxis(Direction::LEFT);
+      }
+      if(animateObjects && mode >= 3)
+        animateScene();
+      accumulatedPasses = 0;
       draw();
       window.renderFrame();
     }
     // We MUST poll for events - otherwise the window will freeze !
-    if(window.pollForInputEvents(&event)){
+    if(interrupted || window.pollForInputEvents(&event)){
+      interrupted = false;
       if(event.type == SDL_KEYDOWN){
       update(event);
-      draw();
+      //CASE: Ray tracing, show coarse previews before the full frame
+      if(mode == 3 && previewRefinement)
+        interrupted = refineProgressively(event);
+      else {
+        draw();
 
     // Need to render the frame at the end, or nothing actually gets shown on the screen !
-    window.renderFrame();}}
+    window.renderFrame();}}}
+    //Nothing changed, refine the ray or path traced image with another pass
+    else if(((progressive && mode == 3) || mode == 4) && !animation && !animateObjects){
+      draw();
+      window.renderFrame();
+    }
   }
   return 0;
 }
@@ -168,66 +339,66 @@ int main(int argc, char* argv[]) {
 //SDL draw funtion
 void draw() {
   window.clearPixels();
+  //Views of the scene, nothing below copies the triangles
+  SceneView scene(modelTriangles, &sceneInstances);
+  SceneView logo(logoTriangles, NULL);
   //Iterate though all triangles
-  if(mode != 3){
+  if(mode < 3){
+    //CASE: Baked lighting is stale, bake it again before drawing
+    if(mode == 1 && bakedLighting && !lightmap->matches(lightPos, directLightPower, indirectLightPower, sceneInstances.version))
+      bakeLightmap(scene);
+    //CASE: Light or scene moved since the shadow map was drawn
+    if(mode == 1 && shadowMapping && !shadowMap->matches(lightPos, sceneInstances.version))
+      renderShadowMap(scene);
     initDepthBuffer();
-    std::vector<CanvasTriangle> canvasTriangles = convertModelToCanvas(modelTriangles);
-    std::vector<CanvasTriangle> canvasLogo = convertModelToCanvas(logoTriangles);
-    for(int i = 0; i < canvasTriangles.size(); i++){
+    std::vector<CanvasTriangle> canvasTriangles = convertModelToCanvas(scene);
+    std::vector<CanvasTriangle> canvasLogo = convertModelToCanvas(logo);
+    //CASE: Screen tiles rasterised in parallel, the same pixels as one after another
+    if(mode == 1 && tiledRasterisation)
+      rasteriseTiled(canvasTriangles, canvasLogo);
+    else {
+      for(int i = 0; i < canvasTriangles.size(); i++){
+        if(mode == 1)
+          rasterisation(canvasTriangles[i], canvasTriangles[i].colour,0);
+        if(mode == 2)
+          drawWireframe(canvasTriangles[i], canvasTriangles[i].colour);
+      }
       if(mode == 1)
-        rasterisation(canvasTriangles[i], canvasTriangles[i].colour,0);
-      if(mode == 2)
-        drawWireframe(canvasTriangles[i], canvasTriangles[i].colour);
+        for(int i=0; i<canvasLogo.size(); i++)
+          rasterisation(canvasLogo[i], Colour(255,255,255),1);
     }
-    if(mode == 1)
-      for(int i=0; i<canvasLogo.size(); i++)
-        rasterisation(canvasLogo[i], Colour(255,255,255),1);
   }
-  else
-    rayTracing(modelTriangles);
-  if(mode != 3) {
-//  applyAntiAliasing();
+  else if(mode == 3) {
+    rayTracing(scene);
+    if(edgeSupersampling)
+      antiAliasing(scene);
+    if(progressive)
+      accumulatePass();
+  }
+  else {
+    pathTracing(scene);
   }
-  else{
-    //antiAliasing(modelTriangles);
+  if(mode >= 3 && denoise)
+    denoiseFrame();
+  if(mode < 3) {
+//  applyAntiAliasing();
   }
   putPixels();
-  saveImage();
+  //Progressive passes only save when the pass count doubles
+  bool refining = (progressive && mode == 3) || mode == 4;
+  if(!refining || (accumulatedPasses & (accumulatedPasses - 1)) == 0)
+    saveImage();
   std::cout<<"Done scene"<<std::endl;
 }
 ////Utilities
 //////////////////////////////////////////////////////////////////////////////////////////////////
-//Load materials
+//Load materials into the material table, rasterising only uses their colours
 std::map<std::string, Colour> loadMaterials(std::string img){
-
- std::ifstream file(img);
- std::string name;
- std::string values;
- std::string empty;
-
- std::string* nameVec;
- std::string* valuesVec;
-
- float red;
- float green;
- float blue;
- Colour colour;
+ materialTable.load(img);
  std::map<std::string, Colour> materials;
-
- while(file){
-   std::getline(file, name);
-   std::getline(file, values);
-   std::getline(file, empty);
-
-   nameVec = split(name, ' ');
-   valuesVec = split(values, ' ');
-   red = 255 * stof(valuesVec[1]);
-   green = 255 * stof(valuesVec[2]);
-   blue = 255 * stof(valuesVec[3]);
-
-   colour = Colour(int(red),int(green),int(blue));
-
-   materials[nameVec[1]] = colour;
+ for(int i = 0; i < materialTable.size(); i++){
+   const Material& material = materialTable[i];
+   materials[material.name] = Colour(material.name,int(255 * material.diffuse.x),int(255 * material.diffuse.y),int(255 * material.diffuse.z));
  }
  return materials;
 }
@@ -242,6 +413,7 @@ void loadTriangles(std::string imgName, std::map<std::string, Colour> materials)
  ModelTriangle triangle;
  glm::vec3 vertex;
  Colour colour;
+ int material = 0;
 
  while(file) {
     std::getline(file, line);
@@ -254,6 +426,7 @@ void loadTriangles(std::string imgName, std::map<std::string, Colour> materials)
 
     if(lineVal[0].compare("usemtl") == 0){
       colour = materials[lineVal[1]];
+      material = materialTable.find(lineVal[1]);
     }
 
     if(lineVal[0].compare("f") == 0){
@@ -262,33 +435,37 @@ void loadTriangles(std::string imgName, std::map<std::string, Colour> materials)
       std::string v3 = lineVal[3].substr(0, lineVal[3].size()-1);
 
       triangle = ModelTriangle(vertices[std::stoi(v1) - 1], vertices[std::stoi(v2) - 1], vertices[std::stoi(v3) - 1], colour);
+      triangle.material = material;
       modelTriangles.push_back(triangle);
     }
  }
 }
 
-//Load sphere
-void loadSphere(std::string imgName, std::map<std::string, Colour> materials){
+//Load sphere in object space, buildInstancedScene places it in the box
+std::vector<ModelTriangle> loadSphere(std::string imgName, std::map<std::string, Colour> materials){
  std::ifstream file(imgName);
  std::string line;
  std::string* lineVal;
 
  std::vector<glm::vec3> vertices;
+ std::vector<ModelTriangle> triangles;
  ModelTriangle triangle;
  glm::vec3 vertex;
  Colour colour;
+ int material = 0;
 
  while(file) {
     std::getline(file, line);
     lineVal = split(line, ' ');
 
     if(lineVal[0].compare("v") == 0) {
-      vertex = glm::vec3(-stof(lineVal[1]) + 1, stof(lineVal[2]) + 3.8, stof(lineVal[3]) - 5);
+      vertex = glm::vec3(-stof(lineVal[1]), stof(lineVal[2]), stof(lineVal[3]));
       vertices.push_back(vertex);
     }
 
     if(lineVal[0].compare("usemtl") == 0){
       colour = materials[lineVal[1]];
+      material = materialTable.find(lineVal[1]);
     }
 
     if(lineVal[0].compare("f") == 0){
@@ -297,12 +474,14 @@ void loadSphere(std::string imgName, std::map<std::string, Colour> materials){
       std::string v3 = lineVal[3].substr(0, lineVal[3].size()-1);
 
       triangle = ModelTriangle(vertices[std::stoi(v1) - 1], vertices[std::stoi(v2) - 1], vertices[std::stoi(v3) - 1], colour);
-      modelTriangles.push_back(triangle);
+      triangle.material = material;
+      triangles.push_back(triangle);
     }
  }
+ return triangles;
 }
 
-// Load logo
+// Load logo in object space, buildInstancedScene places it in the box
 std::vector<ModelTriangle> loadLogo (std::string imgName){
 
   std::ifstream file(imgName);
@@ -323,7 +502,7 @@ std::vector<ModelTriangle> loadLogo (std::string imgName){
       lineVal = split(line, ' ');
 
      if(lineVal[0].compare("v") == 0) {
-        vertex = glm::vec3(stof(lineVal[1])/200 - 2.5, stof(lineVal[2])/200 + 2, stof(lineVal[3])/200 - 5);
+        vertex = glm::vec3(stof(lineVal[1]), stof(lineVal[2]), stof(lineVal[3]));
         vertices.push_back(vertex);
       }
 
@@ -375,7 +554,7 @@ std::vector<ModelTriangle> calculateNormals(std::vector<ModelTriangle> triangles
 }
 
 //Calculate vertex normal
-glm::vec3 calculateVertexNormal(std::vector<ModelTriangle> modelTriangles, glm::vec3 modelVertex){
+glm::vec3 calculateVertexNormal(const std::vector<ModelTriangle>& modelTriangles, glm::vec3 modelVertex){
   std::vector<glm::vec3> normals;
   float xTotal,yTotal,zTotal;
   for(int i = 0; i  < modelTriangles.size(); i++){
@@ -485,6 +664,8 @@ void update(SDL_Event event) {
   //If a key is pressed
   if(event.type == SDL_KEYDOWN) {
     std::cout<<"Key"<<std::endl;
+    //Any input restarts the progressive accumulation
+    accumulatedPasses = 0;
     if(event.key.keysym.sym == SDLK_LEFT) {
 		// Move camera to the left
 		  cameraPos += GetAxis(Direction::LEFT);
@@ -538,6 +719,108 @@ void update(SDL_Event event) {
     else if(event.key.keysym.sym == SDLK_3) {
       mode = 3;
     }
+    else if(event.key.keysym.sym == SDLK_4) {
+      mode = 4;
+    }
+    else if(event.key.keysym.sym == SDLK_b) {
+      useBVH = !useBVH;
+      std::cout<<(useBVH ? "BVH traversal" : "Linear scan")<<std::endl;
+    }
+    else if(event.key.keysym.sym == SDLK_g) {
+      useWideBVH = !useWideBVH;
+      std::cout<<(useWideBVH ? "Wide BVH traversal" : "Binary BVH traversal")<<std::endl;
+    }
+    else if(event.key.keysym.sym == SDLK_k) {
+      usePacketTracing = !usePacketTracing;
+      std::cout<<(usePacketTracing ? "Packet primary rays" : "Single primary rays")<<std::endl;
+    }
+    else if(event.key.keysym.sym == SDLK_m) {
+      benchmarkIntersectionKernels(SceneView(modelTriangles, &sceneInstances));
+    }
+    else if(event.key.keysym.sym == SDLK_p) {
+      progressive = !progressive;
+      std::cout<<(progressive ? "Progressive ray tracing on" : "Progressive ray tracing off")<<std::endl;
+    }
+    else if(event.key.keysym.sym == SDLK_i) {
+      toggleCrowd();
+    }
+    else if(event.key.keysym.sym == SDLK_o) {
+      toggleObjectAnimation();
+    }
+    else if(event.key.keysym.sym == SDLK_c) {
+      batchSecondaryRays = !batchSecondaryRays;
+      std::cout<<(batchSecondaryRays ? "Batched secondary rays" : "Recursive secondary rays")<<std::endl;
+    }
+    else if(event.key.keysym.sym == SDLK_v) {
+      useWavefront = !useWavefront;
+      std::cout<<(useWavefront ? "Wavefront ray tracing" : "Tiled ray tracing")<<std::endl;
+    }
+    else if(event.key.keysym.sym == SDLK_t) {
+      bakedLighting = !bakedLighting;
+      std::cout<<(bakedLighting ? "Baked ray traced lighting" : "Per vertex lighting")<<std::endl;
+    }
+    else if(event.key.keysym.sym == SDLK_5) {
+      shadowMapping = !shadowMapping;
+      std::cout<<(shadowMapping ? "Shadow mapping" : "No shadows")<<" in rasteriser mode"<<std::endl;
+    }
+    else if(event.key.keysym.sym == SDLK_6) {
+      shadowFiltering = !shadowFiltering;
+      std::cout<<(shadowFiltering ? "PCF filtered shadows" : "Hard shadows")<<std::endl;
+    }
+    else if(event.key.keysym.sym == SDLK_SEMICOLON) {
+      tiledRasterisation = !tiledRasterisation;
+      std::cout<<(tiledRasterisation ? "Tiled parallel rasteriser" : "Serial rasteriser")<<std::endl;
+    }
+    else if(event.key.keysym.sym == SDLK_z) {
+      useHybrid = !useHybrid;
+      std::cout<<(useHybrid ? "Hybrid ray tracing, rasterised primary visibility" : "Ray traced primary visibility")<<std::endl;
+    }
+    else if(event.key.keysym.sym == SDLK_LEFTBRACKET) {
+      maxBounceDepth = std::max(0, maxBounceDepth - 1);
+      std::cout<<"Max bounce depth "<<maxBounceDepth<<std::endl;
+    }
+    else if(event.key.keysym.sym == SDLK_RIGHTBRACKET) {
+      maxBounceDepth++;
+      std::cout<<"Max bounce depth "<<maxBounceDepth<<std::endl;
+    }
+    else if(event.key.keysym.sym == SDLK_MINUS) {
+      lightSamples = std::max(1, lightSamples - 1);
+      lightSampler.build(lightSamples, LIGHT_SAMPLE_SEED);
+      std::cout<<lightSamples<<" light samples"<<std::endl;
+    }
+    else if(event.key.keysym.sym == SDLK_EQUALS) {
+      lightSamples++;
+      lightSampler.build(lightSamples, LIGHT_SAMPLE_SEED);
+      std::cout<<lightSamples<<" light samples"<<std::endl;
+    }
+    else if(event.key.keysym.sym == SDLK_n) {
+      denoise = !denoise;
+      std::cout<<(denoise ? "Denoiser on" : "Denoiser off")<<std::endl;
+    }
+    else if(event.key.keysym.sym == SDLK_h || event.key.keysym.sym == SDLK_j) {
+      lightPos.x += event.key.keysym.sym == SDLK_h ? -LIGHT_STEP : LIGHT_STEP;
+      std::cout<<"Light at "<<glm::to_string(lightPos)<<std::endl;
+    }
+    else if(event.key.keysym.sym == SDLK_u || event.key.keysym.sym == SDLK_y) {
+      lightPos.z += event.key.keysym.sym == SDLK_u ? -LIGHT_STEP : LIGHT_STEP;
+      std::cout<<"Light at "<<glm::to_string(lightPos)<<std::endl;
+    }
+    else if(event.key.keysym.sym == SDLK_9 || event.key.keysym.sym == SDLK_0) {
+      directLightPower = std::max(0.f, directLightPower + (event.key.keysym.sym == SDLK_9 ? -DIRECT_POWER_STEP : DIRECT_POWER_STEP));
+      std::cout<<"Direct light power "<<directLightPower<<std::endl;
+    }
+    else if(event.key.keysym.sym == SDLK_7 || event.key.keysym.sym == SDLK_8) {
+      indirectLightPower = std::max(0.f, indirectLightPower + (event.key.keysym.sym == SDLK_7 ? -INDIRECT_POWER_STEP : INDIRECT_POWER_STEP));
+      std::cout<<"Indirect light power "<<indirectLightPower<<std::endl;
+    }
+    else if(event.key.keysym.sym == SDLK_r) {
+      previewRefinement = !previewRefinement;
+      std::cout<<(previewRefinement ? "Coarse to fine previews on" : "Coarse to fine previews off")<<std::endl;
+    }
+    else if(event.key.keysym.sym == SDLK_x) {
+      edgeSupersampling = !edgeSupersampling;
+      std::cout<<(edgeSupersampling ? "Edge supersampling on" : "Edge supersampling off")<<std::endl;
+    }
     else if(event.key.keysym.sym == SDLK_l) {
       lock = !lock;
     }
@@ -610,34 +893,39 @@ void initDepthBuffer() {
 }
 
 //Convert triangles from 3D to 2D
-std::vector<CanvasTriangle> convertModelToCanvas(std::vector<ModelTriangle> triangles) {
+std::vector<CanvasTriangle> convertModelToCanvas(const SceneView& scene) {
   std::vector<CanvasTriangle> canvasTriangles;
-  for(int i = 0; i  < triangles.size(); i++) {
+  for(int i = 0; i  < scene.size(); i++) {
 
-       CanvasPoint v1 = convertModelVertexToCanvasPoint(triangles[i].vertices[0],triangles[i].normals[0]);
-       CanvasPoint v2 = convertModelVertexToCanvasPoint(triangles[i].vertices[1],triangles[i].normals[1]);
-       CanvasPoint v3 = convertModelVertexToCanvasPoint(triangles[i].vertices[2],triangles[i].normals[2]);
+       CanvasPoint v1 = convertModelVertexToCanvasPoint(scene[i].vertices[0],scene[i].normals[0]);
+       CanvasPoint v2 = convertModelVertexToCanvasPoint(scene[i].vertices[1],scene[i].normals[1]);
+       CanvasPoint v3 = convertModelVertexToCanvasPoint(scene[i].vertices[2],scene[i].normals[2]);
 
-       v1.texturePoint = triangles[i].texturePoint[0];
-       v2.texturePoint = triangles[i].texturePoint[1];
-       v3.texturePoint = triangles[i].texturePoint[2];
+       v1.texturePoint = scene[i].texturePoint[0];
+       v2.texturePoint = scene[i].texturePoint[1];
+       v3.texturePoint = scene[i].texturePoint[2];
 
        // dividing by z for persepctive correctness
-       v1.texturePoint.x /= triangles[i].vertices[0].z;
-       v1.texturePoint.y /= triangles[i].vertices[0].z;
-       v2.texturePoint.x /= triangles[i].vertices[1].z;
-       v2.texturePoint.y /= triangles[i].vertices[1].z;
-       v3.texturePoint.x /= triangles[i].vertices[2].z;
-       v3.texturePoint.y /= triangles[i].vertices[2].z;
+       v1.texturePoint.x /= scene[i].vertices[0].z;
+       v1.texturePoint.y /= scene[i].vertices[0].z;
+       v2.texturePoint.x /= scene[i].vertices[1].z;
+       v2.texturePoint.y /= scene[i].vertices[1].z;
+       v3.texturePoint.x /= scene[i].vertices[2].z;
+       v3.texturePoint.y /= scene[i].vertices[2].z;
+
+       //Barycentric corners, divided by z like the texture points
+       v2.lightmapPoint = glm::vec2(v2.depth, 0);
+       v3.lightmapPoint = glm::vec2(0, v3.depth);
 
 orientationMatrix = RotationX * RotationY;
-       CanvasTriangle triangle = CanvasTriangle(v1,v2,v3,triangles[i].colour);
+       CanvasTriangle triangle = CanvasTriangle(v1,v2,v3,scene[i].colour);
+       triangle.triangleIndex = i;
        //Back-face culling
-       if(glm::dot((triangles[i].vertices[0] - cameraPos)*orientationMatrix,triangles[i].triangleNormal) < 0)
+       if(glm::dot((scene[i].vertices[0] - cameraPos)*orientationMatrix,scene[i].triangleNormal) < 0)
        //Far place clipping
-       if(getDistance(cameraPos,triangles[i].vertices[0]) < 30 && getDistance(cameraPos,triangles[i].vertices[1]) < 30 && getDistance(cameraPos,triangles[i].vertices[2]) < 30)
+       if(getDistance(cameraPos,scene[i].vertices[0]) < 30 && getDistance(cameraPos,scene[i].vertices[1]) < 30 && getDistance(cameraPos,scene[i].vertices[2]) < 30)
        //Near place clipping
-       if(getDistance(cameraPos,triangles[i].vertices[0]) > 8 && getDistance(cameraPos,triangles[i].vertices[1]) > 8 && getDistance(cameraPos,triangles[i].vertices[2]) > 8)
+       if(getDistance(cameraPos,scene[i].vertices[0]) > 8 && getDistance(cameraPos,scene[i].vertices[1]) > 8 && getDistance(cameraPos,scene[i].vertices[2]) > 8)
        canvasTriangles.push_back(triangle);
   }
   return canvasTriangles;
@@ -676,31 +964,185 @@ CanvasPoint convertModelVertexToCanvasPoint(glm::vec3 modelVertex, glm::vec3 nor
     return point;
 }
 
+//Rasterise the depth of the scene around the light into the shadow map
+void renderShadowMap(const SceneView& scene) {
+  auto start = std::chrono::high_resolution_clock::now();
+  shadowMap->clear(lightPos);
+  for(int i = 0; i < scene.size(); i++)
+    shadowMap->drawTriangle(scene[i].vertices);
+  shadowMap->fill(sceneInstances.version);
+  auto end = std::chrono::high_resolution_clock::now();
+  std::cout<<"Shadow map drawn in "<<std::chrono::duration<double, std::milli>(end - start).count()<<" ms"<<std::endl;
+}
+
+//Bake soft shadows and a bounce of indirect light into the lightmap of every
+//rasterised triangle, with the ray tracer's shadow rays and intersections
+void bakeLightmap(const SceneView& scene) {
+  auto start = std::chrono::high_resolution_clock::now();
+  //Shadows and bounces only come from the instances the rasteriser draws,
+  //the crowd and the animated logo are ray traced only
+  SceneView rasterised = scene;
+  rasterised.instanceCount = std::min(scene.instanceCount, baseInstances);
+  if(lightmap->triangles() != scene.size())
+    lightmap->resize(scene.size());
+  scheduler->run(scene.size(), [&](int t) {
+    const ModelTriangle& triangle = scene[t];
+    Random random(t, LIGHT_SAMPLE_SEED);
+    for(int a = 0; a < LIGHTMAP_SIZE; a++)
+      for(int b = 0; b < LIGHTMAP_SIZE; b++) {
+        glm::vec2 point = Lightmap::texelPoint(a, b);
+        glm::vec3 position = triangle.vertices[0] + point.x*(triangle.vertices[1] - triangle.vertices[0]) + point.y*(triangle.vertices[2] - triangle.vertices[0]);
+        glm::vec3 normal = triangle.normals[0] + point.x*(triangle.normals[1] - triangle.normals[0]) + point.y*(triangle.normals[2] - triangle.normals[0]);
+        lightmap->texel(t, a, b) = bakeTexel(rasterised, position, glm::normalize(normal), random);
+      }
+  });
+  lightmap->fill(lightPos, directLightPower, indirectLightPower, sceneInstances.version);
+  auto end = std::chrono::high_resolution_clock::now();
+  std::cout<<"Lightmap baked for "<<scene.size()<<" triangles in "<<std::chrono::duration<double, std::milli>(end - start).count()<<" ms"<<std::endl;
+}
+
+//Light at a surface point: the ray tracer's soft shadowed brightness plus the
+//directly lit colour of what cosine weighted rays from the point reach. Both
+//sets of samples are jittered on a grid, the counts are squares.
+glm::vec3 bakeTexel(const SceneView& scene, glm::vec3 point, glm::vec3 normal, Random& random) {
+  int side = (int) std::sqrt((float) BAKE_LIGHT_SAMPLES);
+  float direct = 0;
+  for(int i = 0; i < BAKE_LIGHT_SAMPLES; i++) {
+    glm::vec3 lightDir = bakeLightPosition((i % side + random.uniform()) / side, (i / side + random.uniform()) / side) - point;
+    float distance = glm::length(lightDir);
+    lightDir /= distance;
+    //CASE:Light is blocked -> do shadow
+    if(isOccluded(scene, point + 0.001f*lightDir, lightDir, distance))
+      direct += 0.1f;
+    //CASE:Light reaches the point, brightness as the ray tracer clamps it
+    else
+      direct += std::min(std::max(directLightPower*std::max(glm::dot(lightDir, normal), 0.f)/(4 * 3.14f * distance * distance) + indirectLightPower, 0.2f), 1.f);
+  }
+  glm::vec3 bounce(0, 0, 0);
+  side = (int) std::sqrt((float) BAKE_BOUNCE_RAYS);
+  for(int i = 0; i < BAKE_BOUNCE_RAYS; i++) {
+    glm::vec3 dir = cosineDirection(normal, (i % side + random.uniform()) / side, (i / side + random.uniform()) / side);
+    RayTriangleIntersection hit = getClosestIntersection(scene, dir, point + 0.001f*dir);
+    //CASE: Intersection not found
+    if(!hit.found())
+      continue;
+    SurfaceHit surface = resolveHit(scene, hit);
+    glm::vec3 hitNormal = glm::normalize(surface.normal);
+    //CASE: Back of a surface, it sends nothing this way
+    if(glm::dot(hitNormal, dir) > 0)
+      continue;
+    glm::vec3 hitPoint = surface.point;
+    glm::vec3 lightDir = bakeLightPosition(random.uniform(), random.uniform()) - hitPoint;
+    float distance = glm::length(lightDir);
+    lightDir /= distance;
+    if(isOccluded(scene, hitPoint + 0.001f*lightDir, lightDir, distance))
+      continue;
+    glm::vec3 albedo = surface.colour / 255.f;
+    bounce += albedo * std::min(directLightPower*std::max(glm::dot(lightDir, hitNormal), 0.f)/(4 * 3.14f * distance * distance), 1.f);
+  }
+  return glm::min(glm::vec3(direct / BAKE_LIGHT_SAMPLES) + bounce / (float) BAKE_BOUNCE_RAYS, glm::vec3(1, 1, 1));
+}
+
+//Point on the area light at (u, v) across it
+glm::vec3 bakeLightPosition(float u, float v) {
+  return glm::vec3(lightPos.x + (2 * u - 1) * LIGHT_SIZE, lightPos.y, lightPos.z + (2 * v - 1) * LIGHT_SIZE);
+}
+
 //RASTERISATION funtion
 void rasterisation(CanvasTriangle triangle, Colour colour,bool texture){
-  isTexture = texture;
-  //Sort vertices
-  if(triangle.vertices[0].y > triangle.vertices[1].y)
-    std::swap(triangle.vertices[0], triangle.vertices[1]);
-  if(triangle.vertices[0].y > triangle.vertices[2].y)
-    std::swap(triangle.vertices[0], triangle.vertices[2]);
-  if(triangle.vertices[1].y > triangle.vertices[2].y)
-    std::swap(triangle.vertices[1], triangle.vertices[2]);
-
-  //Draw edges
-  drawLine(triangle.vertices[0], triangle.vertices[1], colour);
-  drawLine(triangle.vertices[1], triangle.vertices[2], colour);
-  drawLine(triangle.vertices[2], triangle.vertices[0], colour);
+  RasterTriangle raster = setupTriangle(triangle, colour, texture);
+  if(!raster.empty())
+    rasteriseRegion(raster, 0, 0, WIDTH, HEIGHT);
+}
 
+//Set a triangle up for rasterising, with what its pixels are shaded with
+RasterTriangle setupTriangle(const CanvasTriangle& triangle, Colour colour, bool texture) {
+  //Normal on the side facing the camera, from the world space vertices the points keep
+  glm::vec3 corners[3];
+  for(int i = 0; i < 3; i++)
+    corners[i] = glm::vec3(triangle.vertices[i].pos3d.x, triangle.vertices[i].pos3d.y, 1.0f/triangle.vertices[i].pos3d.z);
+  glm::vec3 normal = glm::normalize(glm::cross(corners[1] - corners[0], corners[2] - corners[0]));
+  if(glm::dot(normal, cameraPos - corners[0]) < 0)
+    normal = -normal;
+  int baked = bakedLighting && !texture ? triangle.triangleIndex : -1;
+  return RasterTriangle(triangle, RasterShading(colour, texture, baked, normal), WIDTH, HEIGHT);
+}
 
-  //Split triangle
-  CanvasPoint extra = calculateExtra(triangle);
-  drawLine(triangle.vertices[1], extra, colour);
+//Rasterise the pixels of a triangle in [x0, x1) x [y0, y1). The barycentrics
+//are exact at the top of the triangle and of every tile row and stepped in
+//between, so a tile computes the same pixels as the whole screen does.
+void rasteriseRegion(const RasterTriangle& triangle, int x0, int y0, int x1, int y1) {
+  int minX = std::max(triangle.minX, x0), maxX = std::min(triangle.maxX, x1 - 1);
+  int minY = std::max(triangle.minY, y0), maxY = std::min(triangle.maxY, y1 - 1);
+  float weight1StepY = triangle.edgeStepY[1] * triangle.inverseArea;
+  float weight2StepY = triangle.edgeStepY[2] * triangle.inverseArea;
+  for(int x = minX; x <= maxX; x++) {
+    int64_t e0 = triangle.edge(0, x, minY);
+    int64_t e1 = triangle.edge(1, x, minY);
+    int64_t e2 = triangle.edge(2, x, minY);
+    float weight1 = 0, weight2 = 0;
+    for(int y = minY; y <= maxY; y++) {
+      if(y == minY || y % RASTER_TILE_SIZE == 0) {
+        weight1 = e1 * triangle.inverseArea;
+        weight2 = e2 * triangle.inverseArea;
+      }
+      //CASE: Pixel inside the triangle
+      if(e0 + triangle.edgeBias[0] >= 0 && e1 + triangle.edgeBias[1] >= 0 && e2 + triangle.edgeBias[2] >= 0) {
+        float z = triangle.attributes[0] + weight1 * triangle.toVertex1[0] + weight2 * triangle.toVertex2[0];
+        //CASE: Pixel is the closest to the camera
+        if(z <= depthBuffer[x][y]) {
+          float values[RASTER_ATTRIBUTES];
+          for(int a = 1; a < RASTER_ATTRIBUTES; a++)
+            values[a] = triangle.attributes[a] + weight1 * triangle.toVertex1[a] + weight2 * triangle.toVertex2[a];
+          drawPixel(x, y, z, values[1], values[2], values[3], values[4], glm::vec2(values[5], values[6]), triangle.shading);
+        }
+      }
+      e0 += triangle.edgeStepY[0];
+      e1 += triangle.edgeStepY[1];
+      e2 += triangle.edgeStepY[2];
+      weight1 += weight1StepY;
+      weight2 += weight2StepY;
+    }
+  }
+}
 
-  //Fill top triangle
-  fillTriangle(triangle.vertices[0], extra, triangle.vertices[1],colour);
-  //Fill bottom triangle
-  fillTriangle(triangle.vertices[2], extra, triangle.vertices[1],colour);
+//Sort-middle rasteriser: every triangle is set up once and binned into the
+//screen tiles it overlaps, in drawing order, then each worker takes whole
+//tiles and draws their bins into the tile's part of the depth buffer and
+//screen. No two workers touch the same pixel, so nothing is locked.
+void rasteriseTiled(const std::vector<CanvasTriangle>& triangles, const std::vector<CanvasTriangle>& logo) {
+  int count = triangles.size() + logo.size();
+  std::vector<RasterTriangle> setup(count);
+  scheduler->run(count, [&](int i) {
+    //The scene in its own colours, then the textured logo, as draw() orders them
+    if(i < (int) triangles.size())
+      setup[i] = setupTriangle(triangles[i], triangles[i].colour, 0);
+    else
+      setup[i] = setupTriangle(logo[i - triangles.size()], Colour(255,255,255), 1);
+  });
+  int tilesX = (WIDTH + RASTER_TILE_SIZE - 1) / RASTER_TILE_SIZE;
+  int tilesY = (HEIGHT + RASTER_TILE_SIZE - 1) / RASTER_TILE_SIZE;
+  std::vector<std::vector<int>> bins(tilesX * tilesY);
+  for(int i = 0; i < count; i++) {
+    const RasterTriangle& triangle = setup[i];
+    //CASE: Nothing on screen
+    if(triangle.empty())
+      continue;
+    for(int tx = triangle.minX / RASTER_TILE_SIZE; tx <= triangle.maxX / RASTER_TILE_SIZE; tx++)
+      for(int ty = triangle.minY / RASTER_TILE_SIZE; ty <= triangle.maxY / RASTER_TILE_SIZE; ty++) {
+        int x0 = tx * RASTER_TILE_SIZE, y0 = ty * RASTER_TILE_SIZE;
+        int x1 = std::min(x0 + RASTER_TILE_SIZE, WIDTH) - 1, y1 = std::min(y0 + RASTER_TILE_SIZE, HEIGHT) - 1;
+        if(triangle.overlaps(x0, y0, x1, y1))
+          bins[ty * tilesX + tx].push_back(i);
+      }
+  }
+  scheduler->run(tilesX * tilesY, [&](int tile) {
+    int x0 = (tile % tilesX) * RASTER_TILE_SIZE;
+    int y0 = (tile / tilesX) * RASTER_TILE_SIZE;
+    const std::vector<int>& bin = bins[tile];
+    for(int i = 0; i < (int) bin.size(); i++)
+      rasteriseRegion(setup[bin[i]], x0, y0, x0 + RASTER_TILE_SIZE, y0 + RASTER_TILE_SIZE);
+  });
 }
 
 //Draw line
@@ -714,56 +1156,69 @@ void drawLine(CanvasPoint from,CanvasPoint to, Colour colour){
 
        float xt = canvasPoints[i].texturePoint.x;
        float yt = canvasPoints[i].texturePoint.y;
-
-       float zInv = canvasPoints[i].pos3d.z;
-
-       // perspective correctness
-       // dividing by 1/z to obtain true coordinates
-       xt /= zInv;
-       yt /= zInv;
-
        // CASE: Pixel is on screen
-       if(round(x) >= 0 && round(y) >= 0 && round(x) < WIDTH && round(y) < HEIGHT) {
+       if(round(x) >= 0 && round(y) >= 0 && round(x) < WIDTH && round(y) < HEIGHT)
           //CASE: Pixel is the closest to the camera
-          if(z <= depthBuffer[int(round(x))][int(round(y))]) {
-             float brightness = canvasPoints[i].brightness;
-             //Normalize brightness
-             if(brightness > 1)
-                brightness = 1;
-             else if(brightness < 0.2)
-                brightness = 0.2;
-             //Update buffer
-             depthBuffer[int(round(x))][int(round(y))] = z;
-             // Compute colour
-             float red,green,blue;
-             //CASE: Pixel has texture
-             if(isTexture && xt >= 0 && yt >= 0 && xt < textureWidth && yt < textureHeight) {
-                 if(xt > 299) xt = 299;
-                 if(yt > 299) yt = 299;
-
-                 uint32_t packetColour = ppmtex[round(xt)][round(yt)];
-                 red = packetColour>>16 & 255;
-                 green = packetColour>>8 & 255;
-                 blue = int(packetColour & 255);
-
-                 red = red*brightness;
-                 green = green*brightness;
-                 blue = blue*brightness;
-             }
-             // CASE: Pixel doesn't have texture
-             else {
-                red = colour.red*brightness;
-                green = colour.green*brightness;
-                blue = colour.blue*brightness;
-             }
-
-             glm::vec3 col = glm::vec3(red,green,blue);
-             screen[int(round(x))][int(round(y))] = col;
-          }
-        }
+          if(z <= depthBuffer[int(round(x))][int(round(y))])
+             drawPixel(int(round(x)), int(round(y)), z, canvasPoints[i].brightness, xt, yt, canvasPoints[i].pos3d.z, canvasPoints[i].lightmapPoint, RasterShading(colour, 0, -1, glm::vec3(0, 0, 0)));
    }
 }
 
+//Shade a pixel that passed the depth test and write it. Texture and lightmap
+//points come divided by z, as they are interpolated across the screen.
+void drawPixel(int x, int y, float z, float brightness, float xt, float yt, float zInv, glm::vec2 lightmapPoint, const RasterShading& shading){
+  const Colour& colour = shading.colour;
+  // perspective correctness
+  // dividing by 1/z to obtain true coordinates
+  xt /= zInv;
+  yt /= zInv;
+  lightmapPoint /= z;
+  //Normalize brightness
+  if(brightness > 1)
+     brightness = 1;
+  else if(brightness < 0.2)
+     brightness = 0.2;
+  //CASE: Shadow mapped, the shadowed part takes the ray tracer's shadow brightness
+  if(shadowMapping && mode == 1 && shading.bakedTriangle < 0) {
+     glm::vec3 camera = glm::vec3((x - WIDTH/2) / focalLength, (y - HEIGHT/2) / focalLength, 1) / z;
+     float lit = shadowMap->visibility(cameraPos + orientationMatrix * camera, shading.normal, shadowFiltering);
+     brightness = lit * brightness + (1 - lit) * 0.1f;
+  }
+  //Update buffer
+  depthBuffer[x][y] = z;
+  // Compute colour
+  float red,green,blue;
+  //CASE: Pixel has texture
+  if(shading.texture && xt >= 0 && yt >= 0 && xt < textureWidth && yt < textureHeight) {
+      if(xt > 299) xt = 299;
+      if(yt > 299) yt = 299;
+
+      uint32_t packetColour = ppmtex[round(xt)][round(yt)];
+      red = packetColour>>16 & 255;
+      green = packetColour>>8 & 255;
+      blue = int(packetColour & 255);
+
+      red = red*brightness;
+      green = green*brightness;
+      blue = blue*brightness;
+  }
+  // CASE: Pixel lit from the lightmap
+  else if(shading.bakedTriangle >= 0) {
+     glm::vec3 light = lightmap->sample(shading.bakedTriangle, lightmapPoint.x, lightmapPoint.y);
+     red = colour.red*light.x;
+     green = colour.green*light.y;
+     blue = colour.blue*light.z;
+  }
+  // CASE: Pixel doesn't have texture
+  else {
+     red = colour.red*brightness;
+     green = colour.green*brightness;
+     blue = colour.blue*brightness;
+  }
+
+  screen[x][y] = glm::vec3(red,green,blue);
+}
+
 //Interpolation funtion
 std::vector<CanvasPoint> interpolate(CanvasPoint from, CanvasPoint to){
   std::vector<CanvasPoint> canvasPoints;
@@ -782,6 +1237,7 @@ std::vector<CanvasPoint> interpolate(CanvasPoint from, CanvasPoint to){
   float diff3DZ = to.pos3d.z - from.pos3d.z;
 
   float diffB = to.brightness - from.brightness;
+  glm::vec2 diffLightmap = to.lightmapPoint - from.lightmapPoint;
 
   float numberOfSteps = std::max({abs(diffX), abs(diffY),abs(diffZ),abs(diff3DX),abs(diff3DY),abs(diff3DZ),abs(diffB),abs(diffTextX),abs(diffTextY)}) + 1;
 
@@ -797,6 +1253,7 @@ std::vector<CanvasPoint> interpolate(CanvasPoint from, CanvasPoint to){
   float yTextStepSize = diffTextY/numberOfSteps;
 
   float bStepSize = diffB/numberOfSteps;
+  glm::vec2 lightmapStepSize = diffLightmap/numberOfSteps;
 
   for (float i=0.0; i<numberOfSteps+1; i++) {
        float x = from.x + (xStepSize*i) ;
@@ -818,62 +1275,12 @@ std::vector<CanvasPoint> interpolate(CanvasPoint from, CanvasPoint to){
        CanvasPoint point = CanvasPoint(x,y,z,pos3d);
        point.texturePoint = TexturePoint(xT, yT);
        point.brightness = brightness;
+       point.lightmapPoint = from.lightmapPoint + lightmapStepSize*i;
        canvasPoints.push_back(point);
        }
   return canvasPoints;
 }
 
-// Split the triangle
-CanvasPoint calculateExtra(CanvasTriangle triangle) {
-  float extraX;
-  float extraZ;
-  glm::vec3 extraPos;
-  float brightness;
-  TexturePoint texture;
-
-  std::vector<CanvasPoint> canvasPoints = interpolate(triangle.vertices[0],triangle.vertices[2]);
-
-  for (int i=0; i< canvasPoints.size(); i++) {
-       // CASE: Pixel is at the same height with the middle vertex
-       if(round(canvasPoints[i].y) == round(triangle.vertices[1].y)){
-        extraX = canvasPoints[i].x;
-        extraZ = canvasPoints[i].depth;
-        extraPos = canvasPoints[i].pos3d;
-        brightness = canvasPoints[i].brightness;
-        texture =canvasPoints[i].texturePoint;
-       }
-  }
-  CanvasPoint point = CanvasPoint(extraX,triangle.vertices[1].y,extraZ, extraPos);
-  point.brightness = brightness;
-  point.texturePoint = texture;
-  return point;
-}
-
-// Fill triangle
-void fillTriangle(CanvasPoint v1, CanvasPoint v2, CanvasPoint v3, Colour colour){
-  std::vector<CanvasPoint> canvasPoints1 = interpolate(v1,v2);
-  std::vector<CanvasPoint> canvasPoints2 = interpolate(v1,v3);
-
-
-  for (int i=0; i<canvasPoints1.size(); i++) {
-       for (int j=0; j<canvasPoints2.size()  ; j++) {
-            // CASE: Pixels are at the same height
-            if(round(canvasPoints1[i].y) == round(canvasPoints2[j].y)){
-
-              CanvasPoint from = CanvasPoint(round(canvasPoints1[i].x),round(canvasPoints1[i].y),canvasPoints1[i].depth,canvasPoints1[i].pos3d);
-              CanvasPoint to = CanvasPoint(round(canvasPoints2[j].x),round(canvasPoints2[j].y),canvasPoints2[j].depth,canvasPoints2[j].pos3d);
-
-              from.brightness = canvasPoints1[i].brightness;
-              from.texturePoint = canvasPoints1[i].texturePoint;
-
-              to.brightness = canvasPoints2[j].brightness;
-              to.texturePoint = canvasPoints2[j].texturePoint;
-              drawLine(from, to, colour);
-            }
-       }
-   }
-}
-
 //FXAA
 void applyAntiAliasing(){
   for(int row = 0; row < HEIGHT; row++){ // looping through the square
@@ -1036,45 +1443,603 @@ void drawWireframe(CanvasTriangle triangle, Colour colour) {
 ////RAYTRACING
 //////////////////////////////////////////////////////////////////////////////////////////////////
 //Draw scene
-void rayTracing(std::vector<ModelTriangle> triangles) {
+void rayTracing(const SceneView& scene) {
   //Generate lights
   GenAreaLight();
-  for(int i=0; i < WIDTH; i++) {
-    for(int j=0; j < HEIGHT; j++) {
-      screen[i][j] = traceRayFromCamera(i,j,triangles);
+  if(denoise)
+    denoiser->clearGuides();
+  //Set the camera orientation before the workers read it
+  orientationMatrix = RotationX * RotationY;
+  if(lock)
+     lookAt();
+  //CASE: Stage by stage over the whole frame
+  if(useWavefront) {
+    wavefrontTracing(scene);
+    return;
+  }
+  //CASE: Same camera and scene as the last frame, only the lighting is redone
+  if(gBuffer->matches(cameraPos, orientationMatrix, scene.instances->version)) {
+    shadeGBuffer(scene);
+    return;
+  }
+  gBuffer->invalidate();
+  //CASE: Primary hits from the rasteriser, only the rays after them are traced
+  if(useHybrid) {
+    hybridTracing(scene);
+    return;
+  }
+  //Trace tiles in parallel
+  int tilesX = (WIDTH + TILE_SIZE - 1) / TILE_SIZE;
+  int tilesY = (HEIGHT + TILE_SIZE - 1) / TILE_SIZE;
+  //Mirror and glass rays of the whole frame when they are batched
+  RayQueue secondaryRays;
+  std::mutex secondaryLock;
+  scheduler->run(tilesX * tilesY, [&](int tile) {
+    RayQueue tileRays;
+    RayQueue* deferred = batchSecondaryRays ? &tileRays : NULL;
+    int x0 = (tile % tilesX) * TILE_SIZE;
+    int y0 = (tile / tilesX) * TILE_SIZE;
+    int yEnd = std::min(y0 + TILE_SIZE, HEIGHT);
+    for(int i = x0; i < std::min(x0 + TILE_SIZE, WIDTH); i++) {
+      //CASE: Trace a column of pixels as one packet
+      if(usePacketTracing) {
+        for(int j = y0; j < yEnd; j += PACKET_SIZE) {
+          glm::vec3 colours[PACKET_SIZE];
+          float xs[PACKET_SIZE], ys[PACKET_SIZE];
+          int count = std::min(PACKET_SIZE, yEnd - j);
+          for(int k = 0; k < count; k++) {
+            xs[k] = i;
+            ys[k] = j + k;
+          }
+          tracePacketFromCamera(xs, ys, count, scene, colours, deferred, true);
+          for(int k = 0; k < count; k++)
+            screen[i][j + k] = colours[k];
+        }
+      }
+      else {
+        for(int j = y0; j < yEnd; j++) {
+          screen[i][j] = traceRayFromCamera(i,j,scene,deferred,true);
+        }
+      }
+    }
+    if(!tileRays.empty()) {
+      std::unique_lock<std::mutex> guard(secondaryLock);
+      secondaryRays.append(tileRays.rays);
+    }
+  });
+  if(batchSecondaryRays)
+    traceSecondaryRays(secondaryRays, scene);
+  gBuffer->fill(cameraPos, orientationMatrix, scene.instances->version);
+}
+
+//Shade the frame again from the primary hits of the last one: only shadow
+//rays and the rays off mirrors and glass are traced
+void shadeGBuffer(const SceneView& scene) {
+  auto start = std::chrono::high_resolution_clock::now();
+  RayQueue secondaryRays;
+  std::mutex secondaryLock;
+  scheduler->run(WIDTH, [&](int i) {
+    RayQueue columnRays;
+    RayQueue* deferred = batchSecondaryRays ? &columnRays : NULL;
+    for(int j = 0; j < HEIGHT; j++) {
+      int pixel = i * HEIGHT + j;
+      glm::vec3 dir = glm::normalize(-glm::vec3(i - WIDTH/2, j - HEIGHT/2, focalLength));
+      const RayTriangleIntersection& hit = gBuffer->hits[pixel];
+      const SurfaceHit& surface = gBuffer->surfaces[pixel];
+      if(denoise && hit.found())
+        recordGuide(hit, surface, orientationMatrix*dir, pixel);
+      //CASE: Surface lit straight from the cache
+      if(gBuffer->direct[pixel]) {
+        Colour colour = shadeSurface(hit, surface, scene, dir, pixel);
+        screen[i][j] = glm::vec3(colour.red, colour.green, colour.blue);
+      }
+      //CASE: Miss, back face, mirror or glass
+      else
+        screen[i][j] = shadeCameraHit(hit, surface, dir, scene, pixel, deferred);
+    }
+    if(!columnRays.empty()) {
+      std::unique_lock<std::mutex> guard(secondaryLock);
+      secondaryRays.append(columnRays.rays);
+    }
+  });
+  if(batchSecondaryRays)
+    traceSecondaryRays(secondaryRays, scene);
+  auto end = std::chrono::high_resolution_clock::now();
+  std::cout<<"Shaded from the G-buffer in "<<std::chrono::duration<double, std::milli>(end - start).count()<<" ms"<<std::endl;
+}
+
+//Ray trace the frame from rasterised primary visibility: the triangle seen at
+//each pixel comes from the visibility buffer and only the camera ray against
+//that triangle is intersected, the rest are shadow, mirror and glass rays
+void hybridTracing(const SceneView& scene) {
+  auto start = std::chrono::high_resolution_clock::now();
+  rasteriseVisibility(scene);
+  auto rasterised = std::chrono::high_resolution_clock::now();
+  RayQueue secondaryRays;
+  std::mutex secondaryLock;
+  scheduler->run(WIDTH, [&](int i) {
+    RayQueue columnRays;
+    RayQueue* deferred = batchSecondaryRays ? &columnRays : NULL;
+    for(int j = 0; j < HEIGHT; j++) {
+      int pixel = i * HEIGHT + j;
+      glm::vec3 dir = glm::normalize(-glm::vec3(i - WIDTH/2, j - HEIGHT/2, focalLength));
+      RayTriangleIntersection hit = visibleHit(scene, pixel, orientationMatrix*dir);
+      SurfaceHit surface = resolveHit(scene, hit);
+      recordPrimaryHit(hit, surface, orientationMatrix*dir, pixel);
+      screen[i][j] = shadeCameraHit(hit, surface, dir, scene, pixel, deferred);
+    }
+    if(!columnRays.empty()) {
+      std::unique_lock<std::mutex> guard(secondaryLock);
+      secondaryRays.append(columnRays.rays);
+    }
+  });
+  if(batchSecondaryRays)
+    traceSecondaryRays(secondaryRays, scene);
+  gBuffer->fill(cameraPos, orientationMatrix, scene.instances->version);
+  auto end = std::chrono::high_resolution_clock::now();
+  std::cout<<"Visibility rasterised in "<<std::chrono::duration<double, std::milli>(rasterised - start).count()<<" ms, shaded in "<<std::chrono::duration<double, std::milli>(end - rasterised).count()<<" ms"<<std::endl;
+}
+
+//Rasterise every triangle of the instances in view into the visibility buffer, in
+//camera space so the pixels line up with the camera rays
+void rasteriseVisibility(const SceneView& scene) {
+  const InstancedScene& instanced = *scene.instances;
+  visibility->clear();
+  for(int instance = 0; instance < scene.instanceCount; instance++) {
+    const Instance& placed = instanced.instances[instance];
+    const TriangleStore& store = instanced.meshes[placed.mesh].store;
+    for(int slot = 0; slot < store.size(); slot++) {
+      glm::vec3 v0(store.v0x[slot], store.v0y[slot], store.v0z[slot]);
+      glm::vec3 e0(store.e0x[slot], store.e0y[slot], store.e0z[slot]);
+      glm::vec3 e1(store.e1x[slot], store.e1y[slot], store.e1z[slot]);
+      glm::vec3 vertices[3] = {v0, v0 + e0, v0 + e1};
+      for(int k = 0; k < 3; k++)
+        vertices[k] = (glm::vec3(placed.transform * glm::vec4(vertices[k], 1)) - cameraPos) * orientationMatrix;
+      visibility->drawTriangle(vertices, instance, slot);
     }
   }
 }
 
-//Generate lights
+//Hit of the camera ray through a pixel, intersected only with the triangle
+//the rasteriser found there
+RayTriangleIntersection visibleHit(const SceneView& scene, int pixel, glm::vec3 rayDirection) {
+  int instance = visibility->instance[pixel];
+  //CASE: Nothing rasterised, the ray can still graze an edge between pixel centres
+  if(instance < 0)
+    return getClosestIntersection(scene, rayDirection, cameraPos);
+  const Instance& placed = scene.instances->instances[instance];
+  const Mesh& mesh = scene.instances->meshes[placed.mesh];
+  glm::vec3 origin = glm::vec3(placed.inverse * glm::vec4(cameraPos, 1));
+  glm::vec3 dir = glm::mat3(placed.inverse) * rayDirection;
+  float t, u, v;
+  if(mesh.store.intersect(visibility->slot[pixel], origin, dir, 0.001f, std::numeric_limits<float>::max(), t, u, v))
+    return makeIntersection(scene, instance, visibility->slot[pixel], t, u, v);
+  //CASE: Rasteriser and ray disagree on an edge, trace the ray instead
+  return getClosestIntersection(scene, rayDirection, cameraPos);
+}
+
+//Keep what the frame's own pass found at a pixel: the denoiser guide and the
+//G-buffer entry, with the surface unless the pixel shows something else
+void recordPrimaryHit(const RayTriangleIntersection& hit, const SurfaceHit& surface, glm::vec3 direction, int pixel) {
+  gBuffer->hits[pixel] = hit;
+  gBuffer->surfaces[pixel] = surface;
+  gBuffer->direct[pixel] = 0;
+  //CASE: Intersection not found
+  if(!hit.found())
+    return;
+  if(denoise)
+    recordGuide(hit, surface, direction, pixel);
+  //CASE: Camera sees the back of the triangle, the pixel stays black
+  if(glm::dot((surface.vertex - cameraPos)*orientationMatrix,surface.triangleNormal) > 0)
+    return;
+  //CASE: Mirror or glass, the pixel shows where the bounced ray goes
+  SurfaceType type = materialTable[hit.materialIndex].surface;
+  if(type == MIRROR || type == GLASS)
+    return;
+  gBuffer->direct[pixel] = 1;
+}
+
+//Show a ray traced frame coarse to fine: every 8th pixel, then every 4th and
+//every 2nd, each upsampled to blocks and shown, then the full frame. A key
+//pressed in between stops the refinement, it is left in event and true returned.
+bool refineProgressively(SDL_Event& event) {
+  SceneView scene(modelTriangles, &sceneInstances);
+  GenAreaLight();
+  orientationMatrix = RotationX * RotationY;
+  if(lock)
+     lookAt();
+  //Only the lighting changed when the G-buffer still matches, then the full frame is quick
+  int coarsest = gBuffer->matches(cameraPos, orientationMatrix, sceneInstances.version) ? 1 : PREVIEW_COARSEST_STEP;
+  for(int step = coarsest; step > 1; step /= 2) {
+    auto start = std::chrono::high_resolution_clock::now();
+    tracePreview(scene, step);
+    putPixels();
+    window.renderFrame();
+    auto end = std::chrono::high_resolution_clock::now();
+    std::cout<<"Preview 1/"<<step<<" in "<<std::chrono::duration<double, std::milli>(end - start).count()<<" ms"<<std::endl;
+    //CASE: New key press, the frame it leads to replaces this one. Other
+    //events queued before it are dropped like the main loop drops them
+    while(window.pollForInputEvents(&event))
+      if(event.type == SDL_KEYDOWN)
+        return true;
+  }
+  draw();
+  window.renderFrame();
+  return false;
+}
+
+//Trace the pixels on a grid of step that the previous, twice as coarse grid
+//did not, and fill the step x step block below and right of each with it
+void tracePreview(const SceneView& scene, int step) {
+  scheduler->run((WIDTH + step - 1) / step, [&](int column) {
+    int i = column * step;
+    for(int j = 0; j < HEIGHT; j += step) {
+      bool traced = step < PREVIEW_COARSEST_STEP && i % (2 * step) == 0 && j % (2 * step) == 0;
+      if(!traced)
+        screen[i][j] = traceRayFromCamera(i, j, scene);
+      for(int x = i; x < std::min(i + step, WIDTH); x++)
+        for(int y = j; y < std::min(j + step, HEIGHT); y++)
+          screen[x][y] = screen[i][j];
+    }
+  });
+}
+
+//Trace the mirror and glass rays of a frame breadth first: every bounce the
+//queue is sorted for coherence and traced in batches of packets
+void traceSecondaryRays(RayQueue& queue, const SceneView& scene) {
+  int traced = 0;
+  int depth = 0;
+  double sortTime = 0, traceTime = 0;
+  while(!queue.empty() && depth < maxBounceDepth) {
+    auto start = std::chrono::high_resolution_clock::now();
+    queue.sort(scene.instances->topLevel.nodes[0].bounds);
+    auto sorted = std::chrono::high_resolution_clock::now();
+
+    RayQueue next;
+    std::mutex nextLock;
+    int batches = (queue.size() + SECONDARY_BATCH_SIZE - 1) / SECONDARY_BATCH_SIZE;
+    scheduler->run(batches, [&](int batch) {
+      std::vector<QueuedRay> continued;
+      int end = std::min(queue.size(), (batch + 1) * SECONDARY_BATCH_SIZE);
+      for(int r = batch * SECONDARY_BATCH_SIZE; r < end; r += PACKET_SIZE) {
+        int count = std::min(PACKET_SIZE, end - r);
+        RayTriangleIntersection hits[PACKET_SIZE];
+        //CASE: Neighbours in the sorted queue share a packet
+        if(usePacketTracing) {
+          RayPacket packet;
+          for(int k = 0; k < PACKET_SIZE; k++) {
+            const QueuedRay& ray = queue.rays[r + std::min(k, count - 1)];
+            packet.setRay(k, ray.origin, ray.direction);
+          }
+          getClosestPacketIntersection(scene, packet);
+          for(int k = 0; k < count; k++)
+            if(packet.triangleIndex[k] >= 0)
+              hits[k] = makeIntersection(scene, packet.instanceIndex[k], packet.triangleIndex[k], packet.t[k], packet.u[k], packet.v[k]);
+        }
+        else {
+          for(int k = 0; k < count; k++)
+            hits[k] = getClosestIntersection(scene, queue.rays[r + k].direction, queue.rays[r + k].origin);
+        }
+        for(int k = 0; k < count; k++)
+          resolveQueuedRay(queue.rays[r + k], hits[k], scene, continued);
+      }
+      std::unique_lock<std::mutex> guard(nextLock);
+      next.append(continued);
+    });
+    auto end = std::chrono::high_resolution_clock::now();
+    sortTime += std::chrono::duration<double, std::milli>(sorted - start).count();
+    traceTime += std::chrono::duration<double, std::milli>(end - sorted).count();
+    traced += queue.size();
+    queue.rays.swap(next.rays);
+    depth++;
+  }
+  //Rays still bouncing after the deepest bounce stay black
+  for(int i = 0; i < queue.size(); i++)
+    screen[queue.rays[i].pixel / HEIGHT][queue.rays[i].pixel % HEIGHT] = glm::vec3(0, 0, 0);
+  if(traced > 0)
+    std::cout<<"Secondary rays: "<<traced<<" over "<<depth<<" bounces, sort "<<sortTime<<" ms, trace "
+             <<traceTime<<" ms ("<<traced / (traceTime * 1000)<<" Mrays/s)"<<std::endl;
+}
+
+//Continue a queued ray off the next mirror or glass surface, or shade its pixel
+void resolveQueuedRay(const QueuedRay& ray, const RayTriangleIntersection& hit, const SceneView& scene, std::vector<QueuedRay>& continued) {
+  glm::vec3& pixel = screen[ray.pixel / HEIGHT][ray.pixel % HEIGHT];
+  //CASE: Intersection not found
+  if(!hit.found()) {
+    pixel = glm::vec3(0, 0, 0);
+    return;
+  }
+  SurfaceHit surface = resolveHit(scene, hit);
+  //CASE: Mirror or glass, queue the next ray
+  QueuedRay next = ray;
+  bool glass;
+  if(bounceRay(hit, surface, ray.direction, next.origin, next.direction, glass)) {
+    next.depth++;
+    if(glass)
+      next.glassBounces++;
+    next.throughput *= surfaceReflectance(surface);
+    continued.push_back(next);
+    return;
+  }
+  //CASE: Any other surface, glass brightens it once per pass like the recursive version
+  Colour colour = directLight(hit, surface, scene, ray.direction, ray.pixel);
+  for(int i = 0; i < ray.glassBounces; i++)
+    colour = Colour(colour.red*GLASS_MAGIC_NUMBER,colour.green*GLASS_MAGIC_NUMBER,colour.blue*GLASS_MAGIC_NUMBER);
+  pixel = glm::vec3(colour.red, colour.green, colour.blue);
+}
+
+//Add the frame just traced to the running average and show the average
+void accumulatePass() {
+  if(accumulatedPasses == 0)
+    for(int i = 0; i < WIDTH; i++)
+      for(int j = 0; j < HEIGHT; j++)
+        accumulationBuffer[i][j] = glm::vec3(0, 0, 0);
+  accumulatedPasses++;
+  float weight = 1.0f / accumulatedPasses;
+  for(int i = 0; i < WIDTH; i++)
+    for(int j = 0; j < HEIGHT; j++) {
+      accumulationBuffer[i][j] += screen[i][j];
+      screen[i][j] = accumulationBuffer[i][j] * weight;
+    }
+  std::cout<<"Pass "<<accumulatedPasses<<std::endl;
+}
+
+//Primary hit of a pixel as a guide for the denoiser, with the normal facing the
+//camera. Misses keep no guide, so only found hits are recorded.
+void recordGuide(const RayTriangleIntersection& hit, const SurfaceHit& surface, glm::vec3 direction, int pixel) {
+  //Interpolated normal, so smooth surfaces are not cut into their facets
+  glm::vec3 normal = glm::normalize(surface.normal);
+  if(glm::dot(surface.triangleNormal, direction) > 0)
+    normal *= -1.0f;
+  glm::vec3 albedo = surface.colour / 255.f;
+  //CASE: Mirror or glass, the pixel shows another surface so there is no albedo to take out
+  SurfaceType type = materialTable[hit.materialIndex].surface;
+  if(type == MIRROR || type == GLASS)
+    albedo = glm::vec3(1, 1, 1);
+  denoiser->setGuide(pixel, hit.distanceFromCamera, normal, albedo);
+}
+
+//Filter the noise out of the traced frame on screen
+void denoiseFrame() {
+  auto start = std::chrono::high_resolution_clock::now();
+  denoiser->filter(&screen[0][0], *scheduler);
+  auto end = std::chrono::high_resolution_clock::now();
+  std::cout<<"Denoised in "<<std::chrono::duration<double, std::milli>(end - start).count()<<" ms"<<std::endl;
+}
+
+//Generate lights: pick this pass's shift of the light sample tables, every
+//pass of a progressive render gets a new one and a still frame always the same
 void GenAreaLight() {
-  int index = 0;
-  float min = -0.11;
-  float max = 0.11;
-  for(int i = 0; i < NUM_LIGHT_RAYS; i++) {
-    float offset_x = glm::linearRand(min, max);
-    float offset_z = glm::linearRand(min, max);
-    lightPositionArr[i] = glm::vec3(lightPos.x + offset_x, lightPos.y, lightPos.z + offset_z);
+  lightFrameOffset = LightSampler::sequence(accumulatedPasses);
+}
+
+//Position on the area light of one of a pixel's light samples
+glm::vec3 getLightPosition(int pixel, int sample) {
+  glm::vec2 point = lightSampler.sample(pixel / HEIGHT, pixel % HEIGHT, sample, lightFrameOffset);
+  return glm::vec3(lightPos.x + (2 * point.x - 1) * LIGHT_SIZE, lightPos.y, lightPos.z + (2 * point.y - 1) * LIGHT_SIZE);
+}
+
+//Render the frame as a wavefront: every stage runs over the rays of the whole
+//frame before the next one starts, instead of one recursive path per pixel
+void wavefrontTracing(const SceneView& scene) {
+  //Time of each stage over the frame: generate, intersect, shade, shadow and resolve
+  double stageTime[5] = {0, 0, 0, 0, 0};
+  auto start = std::chrono::high_resolution_clock::now();
+  auto lap = start;
+  auto endStage = [&](int stage) {
+    auto now = std::chrono::high_resolution_clock::now();
+    stageTime[stage] += std::chrono::duration<double, std::milli>(now - lap).count();
+    lap = now;
+  };
+  //Generate: one camera ray per pixel
+  RayQueue rays;
+  rays.rays.resize(WIDTH * HEIGHT);
+  scheduler->run(WIDTH, [&](int i) {
+    for(int j = 0; j < HEIGHT; j++) {
+      QueuedRay& ray = rays.rays[i * HEIGHT + j];
+      ray.origin = cameraPos;
+      ray.direction = orientationMatrix * glm::normalize(-glm::vec3(i - WIDTH/2, j - HEIGHT/2, focalLength));
+      ray.pixel = i * HEIGHT + j;
+      ray.depth = 0;
+      ray.glassBounces = 0;
+      ray.throughput = 1;
+    }
+  });
+  endStage(0);
+
+  std::vector<RayTriangleIntersection> hits;
+  std::vector<ShadedHit> shaded;
+  std::vector<ShadowRay> shadowRays;
+  std::mutex shadeLock;
+  int traced = 0;
+  while(!rays.empty()) {
+    //Intersect: bounced rays are sorted first, camera rays already are coherent
+    if(rays.rays[0].depth > 0)
+      rays.sort(scene.instances->topLevel.nodes[0].bounds);
+    intersectWavefront(rays, scene, hits);
+    traced += rays.size();
+    endStage(1);
+
+    //Shade: end the path, continue it off a mirror or glass, or queue its shadow rays
+    RayQueue next;
+    int batches = (rays.size() + SECONDARY_BATCH_SIZE - 1) / SECONDARY_BATCH_SIZE;
+    scheduler->run(batches, [&](int batch) {
+      std::vector<QueuedRay> continued;
+      std::vector<ShadedHit> batchShaded;
+      std::vector<ShadowRay> batchShadows;
+      for(int r = batch * SECONDARY_BATCH_SIZE; r < std::min(rays.size(), (batch + 1) * SECONDARY_BATCH_SIZE); r++)
+        shadeWavefrontHit(rays.rays[r], hits[r], scene, continued, batchShaded, batchShadows);
+      std::unique_lock<std::mutex> guard(shadeLock);
+      for(int i = 0; i < (int) batchShaded.size(); i++)
+        batchShaded[i].firstShadow += shadowRays.size();
+      next.append(continued);
+      shaded.insert(shaded.end(), batchShaded.begin(), batchShaded.end());
+      shadowRays.insert(shadowRays.end(), batchShadows.begin(), batchShadows.end());
+    });
+    rays.rays.swap(next.rays);
+    endStage(2);
+  }
+
+  //Shadow: any-hit tests of every shadow ray of the frame
+  std::vector<char> occluded(shadowRays.size());
+  int shadowBatches = (shadowRays.size() + SECONDARY_BATCH_SIZE - 1) / SECONDARY_BATCH_SIZE;
+  scheduler->run(shadowBatches, [&](int batch) {
+    for(int s = batch * SECONDARY_BATCH_SIZE; s < std::min((int) shadowRays.size(), (batch + 1) * SECONDARY_BATCH_SIZE); s++)
+      occluded[s] = isOccluded(scene, shadowRays[s].origin, shadowRays[s].direction, shadowRays[s].maxDistance);
+  });
+  endStage(3);
+
+  //Resolve: average the light samples of each shaded hit into its pixel
+  int hitBatches = (shaded.size() + SECONDARY_BATCH_SIZE - 1) / SECONDARY_BATCH_SIZE;
+  scheduler->run(hitBatches, [&](int batch) {
+    for(int h = batch * SECONDARY_BATCH_SIZE; h < std::min((int) shaded.size(), (batch + 1) * SECONDARY_BATCH_SIZE); h++) {
+      const ShadedHit& hit = shaded[h];
+      glm::vec3 total = glm::vec3(0, 0, 0);
+      for(int s = hit.firstShadow; s < hit.firstShadow + hit.shadowCount; s++)
+        total += occluded[s] ? shadowRays[s].shadowed : shadowRays[s].lit;
+      glm::vec3 average = total / (float) hit.shadowCount;
+      Colour colour = Colour(average.x, average.y, average.z);
+      //Glass brightens once per pass like the recursive version
+      for(int i = 0; i < hit.glassBounces; i++)
+        colour = Colour(colour.red*GLASS_MAGIC_NUMBER,colour.green*GLASS_MAGIC_NUMBER,colour.blue*GLASS_MAGIC_NUMBER);
+      screen[hit.pixel / HEIGHT][hit.pixel % HEIGHT] = glm::vec3(colour.red, colour.green, colour.blue);
+    }
+  });
+  endStage(4);
+  std::cout<<"Wavefront traced "<<traced<<" rays in "<<std::chrono::duration<double, std::milli>(lap - start).count()<<" ms (generate "
+           <<stageTime[0]<<", intersect "<<stageTime[1]<<", shade "<<stageTime[2]<<", shadow "<<stageTime[3]<<", resolve "<<stageTime[4]<<" ms)"<<std::endl;
+}
+
+//Closest hit of every ray in the queue, neighbouring rays share a packet
+void intersectWavefront(const RayQueue& rays, const SceneView& scene, std::vector<RayTriangleIntersection>& hits) {
+  hits.assign(rays.size(), RayTriangleIntersection());
+  int batches = (rays.size() + SECONDARY_BATCH_SIZE - 1) / SECONDARY_BATCH_SIZE;
+  scheduler->run(batches, [&](int batch) {
+    int end = std::min(rays.size(), (batch + 1) * SECONDARY_BATCH_SIZE);
+    for(int r = batch * SECONDARY_BATCH_SIZE; r < end; r += PACKET_SIZE) {
+      int count = std::min(PACKET_SIZE, end - r);
+      //CASE: Trace the rays as one packet
+      if(usePacketTracing) {
+        RayPacket packet;
+        for(int k = 0; k < PACKET_SIZE; k++) {
+          const QueuedRay& ray = rays.rays[r + std::min(k, count - 1)];
+          packet.setRay(k, ray.origin, ray.direction);
+        }
+        getClosestPacketIntersection(scene, packet);
+        for(int k = 0; k < count; k++)
+          if(packet.triangleIndex[k] >= 0)
+            hits[r + k] = makeIntersection(scene, packet.instanceIndex[k], packet.triangleIndex[k], packet.t[k], packet.u[k], packet.v[k]);
+      }
+      else {
+        for(int k = 0; k < count; k++)
+          hits[r + k] = getClosestIntersection(scene, rays.rays[r + k].direction, rays.rays[r + k].origin);
+      }
+    }
+  });
+}
+
+//Shade stage for one ray: the pixel goes black, the ray continues into continued,
+//or the hit is lit and queues one shadow ray per light sample
+void shadeWavefrontHit(const QueuedRay& ray, const RayTriangleIntersection& hit, const SceneView& scene, std::vector<QueuedRay>& continued, std::vector<ShadedHit>& shaded, std::vector<ShadowRay>& shadowRays) {
+  glm::vec3& pixel = screen[ray.pixel / HEIGHT][ray.pixel % HEIGHT];
+  //CASE: Intersection not found
+  if(!hit.found()) {
+    pixel = glm::vec3(0, 0, 0);
+    return;
   }
+  SurfaceHit surface = resolveHit(scene, hit);
+  if(ray.depth == 0 && denoise)
+    recordGuide(hit, surface, ray.direction, ray.pixel);
+  //CASE: Camera sees the back of a triangle
+  if(ray.depth == 0 && glm::dot((surface.vertex - cameraPos)*orientationMatrix,surface.triangleNormal) > 0) {
+    pixel = glm::vec3(0, 0, 0);
+    return;
+  }
+  //CASE: Mirror or glass, continue the path unless it is too deep or too dim
+  QueuedRay next = ray;
+  bool glass;
+  if(bounceRay(hit, surface, ray.direction, next.origin, next.direction, glass)) {
+    next.depth++;
+    if(glass)
+      next.glassBounces++;
+    next.throughput *= surfaceReflectance(surface);
+    if(next.depth > maxBounceDepth || next.throughput < MIN_THROUGHPUT)
+      pixel = glm::vec3(0, 0, 0);
+    else
+      continued.push_back(next);
+    return;
+  }
+  //CASE: Any other surface
+  ShadedHit result;
+  result.pixel = ray.pixel;
+  result.glassBounces = ray.glassBounces;
+  result.firstShadow = shadowRays.size();
+  result.shadowCount = lightSampler.size();
+  for(int i = 0; i < lightSampler.size(); i++)
+    shadowRays.push_back(lightSample(hit, surface, ray.direction, getLightPosition(ray.pixel, i)));
+  shaded.push_back(result);
 }
 
 //Trace ray from camera
-glm::vec3 traceRayFromCamera(float x, float y,std::vector<ModelTriangle> triangles) {
-	Colour colour ;
-
+glm::vec3 traceRayFromCamera(float x, float y, const SceneView& scene, RayQueue* deferred, bool primaryPass) {
   //Compute ray direction
   glm::vec3 dir = glm::vec3(x - WIDTH/2, y - HEIGHT/2, focalLength);
   dir = glm::normalize(-dir);
-  orientationMatrix = RotationX * RotationY;
-  //Check for lookAt
-  if(lock)
-     lookAt();
   //Get closest intersection
-  RayTriangleIntersection closestinter = getClosestIntersection(triangles, orientationMatrix*dir, cameraPos);
+  RayTriangleIntersection closestinter = getClosestIntersection(scene, orientationMatrix*dir, cameraPos);
+  SurfaceHit surface = resolveHit(scene, closestinter);
+  if(primaryPass)
+    recordPrimaryHit(closestinter, surface, orientationMatrix*dir, int(x) * HEIGHT + int(y));
+  return shadeCameraHit(closestinter, surface, dir, scene, int(x) * HEIGHT + int(y), deferred);
+}
+
+//Trace the points (xs[k], ys[k]) from camera as one ray packet, count is at most PACKET_SIZE
+void tracePacketFromCamera(const float* xs, const float* ys, int count, const SceneView& scene, glm::vec3* colours, RayQueue* deferred, bool primaryPass) {
+  RayPacket packet;
+  glm::vec3 dirs[PACKET_SIZE];
+  for(int k = 0; k < PACKET_SIZE; k++) {
+    //Unused lanes repeat the last ray
+    int point = std::min(k, count - 1);
+    glm::vec3 dir = glm::vec3(xs[point] - WIDTH/2, ys[point] - HEIGHT/2, focalLength);
+    dirs[k] = glm::normalize(-dir);
+    packet.setRay(k, cameraPos, orientationMatrix*dirs[k]);
+  }
+  getClosestPacketIntersection(scene, packet);
+
+  for(int k = 0; k < count; k++) {
+    RayTriangleIntersection closestinter = RayTriangleIntersection();
+    //CASE: Intersection found
+    if(packet.triangleIndex[k] >= 0)
+      closestinter = makeIntersection(scene, packet.instanceIndex[k], packet.triangleIndex[k], packet.t[k], packet.u[k], packet.v[k]);
+    SurfaceHit surface = resolveHit(scene, closestinter);
+    if(primaryPass)
+      recordPrimaryHit(closestinter, surface, orientationMatrix*dirs[k], int(xs[k]) * HEIGHT + int(ys[k]));
+    colours[k] = shadeCameraHit(closestinter, surface, dirs[k], scene, int(xs[k]) * HEIGHT + int(ys[k]), deferred);
+  }
+}
+
+//Shade the closest intersection of a camera ray
+//A deferred mirror or glass hit is queued for pixel instead of followed
+glm::vec3 shadeCameraHit(const RayTriangleIntersection& closestinter, const SurfaceHit& surface, glm::vec3 dir, const SceneView& scene, int pixel, RayQueue* deferred) {
+	Colour colour ;
   float check = std::numeric_limits<float>::max();
+  bool backFacing = false;
+  if(closestinter.found())
+    backFacing = glm::dot((surface.vertex - cameraPos)*orientationMatrix,surface.triangleNormal) > 0;
+  QueuedRay next;
+  bool glass;
+  //CASE: Mirror or glass while batching, traced later with the rest of the frame
+  if(deferred != NULL && closestinter.found() && !backFacing && bounceRay(closestinter, surface, dir, next.origin, next.direction, glass)) {
+    next.pixel = pixel;
+    next.depth = 1;
+    next.glassBounces = glass ? 1 : 0;
+    next.throughput = surfaceReflectance(surface);
+    deferred->push(next);
+    colour = Colour(0, 0, 0);
+  }
   //CASE: Intersection found
-  if(closestinter.distanceFromCamera < check) {
-    colour = directLight(closestinter, triangles, dir);
+  else if(closestinter.distanceFromCamera < check) {
+    colour = directLight(closestinter, surface, scene, dir, pixel);
   }
   //CASE: Intersection not found
   else {
@@ -1082,8 +2047,8 @@ glm::vec3 traceRayFromCamera(float x, float y,std::vector<ModelTriangle> triangl
   }
 
 
-   if(glm::dot((closestinter.intersectedTriangle.vertices[0] - cameraPos)*orientationMatrix,closestinter.intersectedTriangle.triangleNormal) > 0)
-   colour = Colour(0, 0, 0);
+   if(backFacing)
+     colour = Colour(0, 0, 0);
   //Colour pixel
   float red = colour.red;
   float green = colour.green;
@@ -1097,34 +2062,416 @@ glm::vec3 traceRayFromCamera(float x, float y,std::vector<ModelTriangle> triangl
 }
 
 //Get closest intersection
-RayTriangleIntersection getClosestIntersection(std::vector<ModelTriangle> triangles,  glm::vec3 rayDirection,glm::vec3 start ) {
-
+RayTriangleIntersection getClosestIntersection(const SceneView& scene, glm::vec3 rayDirection, glm::vec3 start) {
+  const InstancedScene& instanced = *scene.instances;
   float minDist = std::numeric_limits<float>::max();
-  RayTriangleIntersection result = RayTriangleIntersection();
-  result.distanceFromCamera = minDist;
-
-  for(int i = 0; i < triangles.size(); i++) {
-    //Compute intersection
-    glm::vec3 intersect = intersection(triangles[i], rayDirection, start);
-    float t, u, v;
-    t = intersect[0];
-    u = intersect[1];
-    v = intersect[2];
-    //CASE:Intersection found
-    if(t < minDist
-        && 0.0 <= u && u <= 1.0
-          && 0.0 <= v && v <= 1.0
-            && (u + v) <= 1.0 && t >= 0.001) {
-      minDist = t;
-      //Save intersection data
-      result.intersectionPoint = triangles[i].vertices[0] + u*(triangles[i].vertices[1] - triangles[i].vertices[0])+ v*(triangles[i].vertices[2] - triangles[i].vertices[0]);
-      result.distanceFromCamera = minDist;
-      result.intersectedTriangle = triangles[i];
-      result.normal = triangles[i].normals[0] + u*(triangles[i].normals[1] - triangles[i].normals[0])+ v*(triangles[i].normals[2] - triangles[i].normals[0]);
-      result.triangleIndex = i;
+
+  //Closest hit so far, kept as an instance and store slot until the search is over
+  int closestInstance = -1;
+  int closestSlot = -1;
+  float closestU = 0, closestV = 0;
+  auto testInstance = [&](int instance) {
+    //CASE: Instance is outside the view
+    if(instance >= scene.instanceCount)
+      return;
+    const Instance& placed = instanced.instances[instance];
+    const Mesh& mesh = instanced.meshes[placed.mesh];
+    //Move the ray into the mesh's object space
+    glm::vec3 origin = glm::vec3(placed.inverse * glm::vec4(start, 1));
+    glm::vec3 dir = glm::mat3(placed.inverse) * rayDirection;
+    auto testSlot = [&](int slot) {
+      float t, u, v;
+      if(mesh.store.intersect(slot, origin, dir, 0.001f, minDist, t, u, v)) {
+        minDist = t;
+        closestU = u;
+        closestV = v;
+        closestSlot = slot;
+        closestInstance = instance;
+      }
+    };
+    //CASE: Linear scan
+    if(!useBVH) {
+      for(int slot = 0; slot < mesh.store.size(); slot++)
+        testSlot(slot);
+    }
+    //CASE: Wide bottom level BVH, the triangles of a leaf are tested together
+    else if(useWideBVH) {
+      mesh.wideBvh.traverseClosest(origin, dir, minDist, [&](int first, int count) {
+        float t, u, v;
+        int slot;
+        if(intersectStoreSlots(mesh.store, first, count, origin, dir, 0.001f, minDist, t, u, v, slot)) {
+          minDist = t;
+          closestU = u;
+          closestV = v;
+          closestSlot = slot;
+          closestInstance = instance;
+        }
+      });
+    }
+    //CASE: Bottom level BVH, the triangles of a leaf are contiguous in the store
+    else {
+      mesh.bvh.traverseClosest(origin, dir, minDist, [&](int first, int count) {
+        for(int slot = first; slot < first + count; slot++)
+          testSlot(slot);
+      });
+    }
+  };
+
+  auto testInstances = [&](int first, int count) {
+    for(int i = first; i < first + count; i++)
+      testInstance(instanced.topLevel.primitiveIndices[i]);
+  };
+  //CASE: Linear scan
+  if(!useBVH) {
+    for(int instance = 0; instance < scene.instanceCount; instance++)
+      testInstance(instance);
+  }
+  //CASE: Wide top level BVH, nearest instance first
+  else if(useWideBVH)
+    instanced.wideTopLevel.traverseClosest(start, rayDirection, minDist, testInstances);
+  //CASE: Top level BVH, nearest instance first
+  else
+    instanced.topLevel.traverseClosest(start, rayDirection, minDist, testInstances);
+
+  //CASE: Intersection found
+  if(closestSlot >= 0)
+    return makeIntersection(scene, closestInstance, closestSlot, minDist, closestU, closestV);
+  return RayTriangleIntersection();
+}
+
+//Check whether anything lies on the ray within maxDist, stopping at the first hit
+bool isOccluded(const SceneView& scene, glm::vec3 origin, glm::vec3 dir, float maxDist) {
+  const InstancedScene& instanced = *scene.instances;
+  //Hits exactly at maxDist still count as blocking
+  float tMax = std::nextafter(maxDist, std::numeric_limits<float>::max());
+
+  auto instanceOccludes = [&](int instance) {
+    //CASE: Instance is outside the view
+    if(instance >= scene.instanceCount)
+      return false;
+    const Instance& placed = instanced.instances[instance];
+    const Mesh& mesh = instanced.meshes[placed.mesh];
+    glm::vec3 localOrigin = glm::vec3(placed.inverse * glm::vec4(origin, 1));
+    glm::vec3 localDir = glm::mat3(placed.inverse) * dir;
+    auto slotsOcclude = [&](int first, int count) {
+      float t, u, v;
+      for(int slot = first; slot < first + count; slot++)
+        if(mesh.store.intersect(slot, localOrigin, localDir, 0.001f, tMax, t, u, v))
+          return true;
+      return false;
+    };
+    //CASE: Linear scan
+    if(!useBVH)
+      return slotsOcclude(0, mesh.store.size());
+    //CASE: Wide bottom level BVH, the triangles of a leaf are tested together
+    if(useWideBVH)
+      return mesh.wideBvh.traverseAny(localOrigin, localDir, tMax, [&](int first, int count) {
+        float t, u, v;
+        int slot;
+        return intersectStoreSlots(mesh.store, first, count, localOrigin, localDir, 0.001f, tMax, t, u, v, slot);
+      });
+    //CASE: Bottom level BVH, the order of the children does not matter
+    return mesh.bvh.traverseAny(localOrigin, localDir, tMax, slotsOcclude);
+  };
+  auto instancesOcclude = [&](int first, int count) {
+    for(int i = first; i < first + count; i++)
+      if(instanceOccludes(instanced.topLevel.primitiveIndices[i]))
+        return true;
+    return false;
+  };
+
+  //CASE: Linear scan
+  if(!useBVH) {
+    for(int instance = 0; instance < scene.instanceCount; instance++)
+      if(instanceOccludes(instance))
+        return true;
+    return false;
+  }
+  //CASE: Wide top level BVH
+  if(useWideBVH)
+    return instanced.wideTopLevel.traverseAny(origin, dir, tMax, instancesOcclude);
+  //CASE: Top level BVH
+  return instanced.topLevel.traverseAny(origin, dir, tMax, instancesOcclude);
+}
+
+//Make the hit record for a store slot of an instance
+RayTriangleIntersection makeIntersection(const SceneView& scene, int instance, int slot, float t, float u, float v) {
+  const Mesh& mesh = scene.instances->meshes[scene.instances->instances[instance].mesh];
+  return RayTriangleIntersection(t, u, v, instance, mesh.store.triangleIndex[slot], mesh.store.materialIndex[slot]);
+}
+
+//World space surface at a hit, resolved once the hit is final, a miss gives an empty record
+SurfaceHit resolveHit(const SceneView& scene, const RayTriangleIntersection& hit) {
+  //CASE: Intersection not found
+  if(!hit.found())
+    return SurfaceHit();
+  return scene.instances->surfaceHit(hit.instanceIndex, hit.triangleIndex, hit.u, hit.v);
+}
+
+//Get closest intersections of a ray packet
+void getClosestPacketIntersection(const SceneView& scene, RayPacket& packet) {
+  const InstancedScene& instanced = *scene.instances;
+  auto testInstance = [&](int instance) {
+    //CASE: Instance is outside the view
+    if(instance >= scene.instanceCount)
+      return;
+    const Instance& placed = instanced.instances[instance];
+    //Trace a copy of the packet in the mesh's object space
+    RayPacket local = packet.transformed(placed.inverse);
+    intersectPacketMesh(instanced.meshes[placed.mesh], local);
+    for(int k = 0; k < PACKET_SIZE; k++)
+      if(local.t[k] < packet.t[k]) {
+        packet.t[k] = local.t[k];
+        packet.u[k] = local.u[k];
+        packet.v[k] = local.v[k];
+        packet.triangleIndex[k] = local.triangleIndex[k];
+        packet.instanceIndex[k] = instance;
+      }
+  };
+
+  //CASE: Test every instance
+  if(!useBVH) {
+    for(int instance = 0; instance < scene.instanceCount; instance++)
+      testInstance(instance);
+  }
+  //CASE: Top level BVH traversal, a node is visited while any ray of the packet hits it
+  else {
+    const BVH& topLevel = instanced.topLevel;
+    int stack[BVH_STACK_SIZE];
+    int stackSize = 0;
+    stack[stackSize++] = 0;
+    while(stackSize > 0) {
+      const BVHNode& node = topLevel.nodes[stack[--stackSize]];
+      if(!intersectPacketBox(packet, node.bounds))
+        continue;
+      if(node.isLeaf()) {
+        for(int i = node.leftFirst; i < node.leftFirst + node.count; i++)
+          testInstance(topLevel.primitiveIndices[i]);
+      }
+      else {
+        stack[stackSize++] = node.leftFirst + 1;
+        stack[stackSize++] = node.leftFirst;
+      }
     }
   }
-  return result;
+}
+
+//Closest hits of a packet against one mesh, the packet is in its object space
+void intersectPacketMesh(const Mesh& mesh, RayPacket& packet) {
+  //CASE: Test every triangle
+  if(!useBVH) {
+    for(int slot = 0; slot < mesh.store.size(); slot++)
+      intersectPacketTriangle(packet, mesh.store.vertex0(slot), mesh.store.edge0(slot), mesh.store.edge1(slot), slot);
+    return;
+  }
+  //CASE: Bottom level BVH traversal
+  int stack[BVH_STACK_SIZE];
+  int stackSize = 0;
+  stack[stackSize++] = 0;
+  while(stackSize > 0) {
+    const BVHNode& node = mesh.bvh.nodes[stack[--stackSize]];
+    if(!intersectPacketBox(packet, node.bounds))
+      continue;
+    if(node.isLeaf()) {
+      for(int slot = node.leftFirst; slot < node.leftFirst + node.count; slot++)
+        intersectPacketTriangle(packet, mesh.store.vertex0(slot), mesh.store.edge0(slot), mesh.store.edge1(slot), slot);
+    }
+    else {
+      stack[stackSize++] = node.leftFirst + 1;
+      stack[stackSize++] = node.leftFirst;
+    }
+  }
+}
+
+//Compare the matrix-inverse kernel against the packet kernel on this frame's camera rays
+void benchmarkIntersectionKernels(const SceneView& scene) {
+  orientationMatrix = RotationX * RotationY;
+  if(lock)
+     lookAt();
+  std::vector<glm::vec3> dirs;
+  for(int i = 0; i < WIDTH; i += 4)
+    for(int j = 0; j < HEIGHT; j += 4)
+      dirs.push_back(orientationMatrix * glm::normalize(-glm::vec3(i - WIDTH/2, j - HEIGHT/2, focalLength)));
+  while(dirs.size() % PACKET_SIZE != 0)
+    dirs.push_back(dirs.back());
+  double tests = (double) dirs.size() * scene.size();
+
+  //Matrix-inverse kernel
+  int scalarHits = 0;
+  auto start = std::chrono::high_resolution_clock::now();
+  for(int r = 0; r < (int) dirs.size(); r++) {
+    RayTriangleIntersection result = RayTriangleIntersection();
+    for(int i = 0; i < scene.size(); i++) {
+      glm::vec3 intersect = intersection(scene[i], dirs[r], cameraPos);
+      float t = intersect[0], u = intersect[1], v = intersect[2];
+      if(t < result.distanceFromCamera && 0.0 <= u && u <= 1.0 && 0.0 <= v && v <= 1.0 && (u + v) <= 1.0 && t >= 0.001) {
+        result.distanceFromCamera = t;
+        result.triangleIndex = i;
+      }
+    }
+    if(result.triangleIndex >= 0)
+      scalarHits++;
+  }
+  auto middle = std::chrono::high_resolution_clock::now();
+
+  //Packet kernel over a flat store of the world space triangles
+  TriangleStore store;
+  std::vector<ModelTriangle> world(scene.begin(), scene.end());
+  std::vector<int> order(world.size());
+  for(int i = 0; i < (int) world.size(); i++)
+    order[i] = i;
+  store.build(world, order, getMaterialIndices(world));
+  int packetHits = 0;
+  for(int r = 0; r < (int) dirs.size(); r += PACKET_SIZE) {
+    RayPacket packet;
+    for(int k = 0; k < PACKET_SIZE; k++)
+      packet.setRay(k, cameraPos, dirs[r + k]);
+    for(int slot = 0; slot < store.size(); slot++)
+      intersectPacketTriangle(packet, store.vertex0(slot), store.edge0(slot), store.edge1(slot), slot);
+    for(int k = 0; k < PACKET_SIZE; k++)
+      if(packet.triangleIndex[k] >= 0)
+        packetHits++;
+  }
+  auto end = std::chrono::high_resolution_clock::now();
+
+  double scalarTime = std::chrono::duration<double, std::nano>(middle - start).count();
+  double packetTime = std::chrono::duration<double, std::nano>(end - middle).count();
+  std::cout<<"Kernel benchmark over "<<dirs.size()<<" rays x "<<scene.size()<<" triangles"<<std::endl;
+  std::cout<<"  matrix inverse: "<<scalarTime/tests<<" ns/test, "<<scalarHits<<" hits"<<std::endl;
+  std::cout<<"  packet of "<<PACKET_SIZE<<":    "<<packetTime/tests<<" ns/test, "<<packetHits<<" hits"<<std::endl;
+  std::cout<<"  speedup: "<<scalarTime/packetTime<<"x"<<std::endl;
+}
+
+//Material id of every triangle, for the intersection stores
+std::vector<int> getMaterialIndices(const std::vector<ModelTriangle>& triangles) {
+  std::vector<int> triangleMaterials(triangles.size());
+  for(int i = 0; i < (int) triangles.size(); i++)
+    triangleMaterials[i] = triangles[i].material;
+  return triangleMaterials;
+}
+
+//Build one bottom level BVH per mesh and place the box and the sphere.
+//The mesh triangles keep the indices the flat list used to have, so the
+//box is 0-31 and the sphere 32-91 whichever instance is hit.
+void buildInstancedScene(const std::vector<ModelTriangle>& box, const std::vector<ModelTriangle>& sphere, const std::vector<ModelTriangle>& logo) {
+  auto start = std::chrono::high_resolution_clock::now();
+  int boxMesh = sceneInstances.addMesh(box, getMaterialIndices(box));
+  sphereMesh = sceneInstances.addMesh(sphere, getMaterialIndices(sphere));
+  logoMesh = sceneInstances.addMesh(logo, getMaterialIndices(logo));
+  sphereRest = sphere;
+  sceneInstances.addInstance(boxMesh, glm::mat4(1));
+  sceneInstances.addInstance(sphereMesh, glm::translate(glm::mat4(1), glm::vec3(1, 3.8, -5)));
+  baseInstances = sceneInstances.instances.size();
+  sceneInstances.buildTopLevel();
+  auto end = std::chrono::high_resolution_clock::now();
+  std::cout<<"Meshes built: "<<sceneInstances.meshes.size()<<" bottom level BVHs in "
+           <<std::chrono::duration<double, std::milli>(end - start).count()<<" ms"<<std::endl;
+
+  //The rasteriser draws flat world space lists
+  modelTriangles = sceneInstances.flatten(0, baseInstances);
+  logoTransform = glm::scale(glm::translate(glm::mat4(1), glm::vec3(-2.5, 2, -5)), glm::vec3(1.0f / 200));
+  glm::mat3 logoNormalMatrix = glm::transpose(glm::inverse(glm::mat3(logoTransform)));
+  logoTriangles.clear();
+  for(int i = 0; i < (int) logo.size(); i++)
+    logoTriangles.push_back(InstancedScene::transformTriangle(logo[i], logoTransform, logoNormalMatrix));
+}
+
+//Add or remove a crowd of small spheres and logos on the floor of the box.
+//Only the top level is rebuilt, every copy shares its mesh.
+void toggleCrowd() {
+  showCrowd = !showCrowd;
+  auto start = std::chrono::high_resolution_clock::now();
+  sceneInstances.removeInstances(baseInstances);
+  if(showCrowd) {
+    const AABB& room = sceneInstances.meshes[0].bounds;
+    for(int i = 0; i < CROWD_SIZE; i++)
+      for(int j = 0; j < CROWD_SIZE; j++) {
+        int mesh = (i + j) % 2 == 0 ? sphereMesh : logoMesh;
+        const AABB& local = sceneInstances.meshes[mesh].bounds;
+        glm::vec3 extent = local.max - local.min;
+        //Fit each copy into its cell and stand it on the floor
+        float cell = (room.max.x - room.min.x) / CROWD_SIZE;
+        float scale = 0.6f * cell / std::max(extent.x, std::max(extent.y, extent.z));
+        glm::vec3 position(room.min.x + (i + 0.5f) * cell,
+                           room.min.y - scale * local.min.y,
+                           room.min.z + (j + 0.5f) * (room.max.z - room.min.z) / CROWD_SIZE);
+        glm::mat4 transform = glm::translate(glm::mat4(1), position - scale * glm::vec3(local.centroid().x, 0, local.centroid().z));
+        sceneInstances.addInstance(mesh, glm::scale(transform, glm::vec3(scale)));
+      }
+  }
+  //The animated logo stays the last instance
+  if(animateObjects)
+    logoInstance = sceneInstances.addInstance(logoMesh, logoTransform);
+  sceneInstances.buildTopLevel();
+  auto end = std::chrono::high_resolution_clock::now();
+
+  int flatTriangles = 0;
+  for(int i = 0; i < (int) sceneInstances.instances.size(); i++)
+    flatTriangles += sceneInstances.meshes[sceneInstances.instances[i].mesh].count;
+  std::cout<<sceneInstances.instances.size()<<" instances, top level rebuilt in "
+           <<std::chrono::duration<double, std::milli>(end - start).count()<<" ms"<<std::endl;
+  std::cout<<"  "<<sceneInstances.triangles.size()<<" stored triangles for "<<flatTriangles<<" placed ones ("
+           <<sceneInstances.instances.size()*sizeof(Instance)/1024<<" KB of instances)"<<std::endl;
+}
+
+//Start or stop moving the sphere and the logo in ray tracing mode.
+//The logo is only ray traced while it is animated.
+void toggleObjectAnimation() {
+  animateObjects = !animateObjects;
+  if(animateObjects) {
+    logoInstance = sceneInstances.addInstance(logoMesh, logoTransform);
+  }
+  else {
+    sceneInstances.removeInstances(logoInstance);
+    logoInstance = -1;
+  }
+  sceneInstances.buildTopLevel();
+  std::cout<<(animateObjects ? "Object animation on" : "Object animation off")<<std::endl;
+}
+
+//Move the sphere and the logo to the next frame and catch the BVHs up with them
+void animateScene() {
+  float phase = animationFrame++ * ANIMATION_SPEED;
+  //Squash and stretch the sphere's vertices in object space, its bottom stays put
+  const Mesh& sphere = sceneInstances.meshes[sphereMesh];
+  float squash = 1 + 0.3f * sin(2 * phase);
+  float bottom = std::numeric_limits<float>::max();
+  for(int i = 0; i < (int) sphereRest.size(); i++)
+    for(int k = 0; k < 3; k++)
+      bottom = std::min(bottom, sphereRest[i].vertices[k].y);
+  for(int i = 0; i < sphere.count; i++) {
+    ModelTriangle& triangle = sceneInstances.triangles[sphere.first + i];
+    const ModelTriangle& rest = sphereRest[i];
+    for(int k = 0; k < 3; k++) {
+      glm::vec3 vertex = rest.vertices[k];
+      glm::vec3 normal = rest.normals[k];
+      triangle.vertices[k] = glm::vec3(vertex.x * squash, bottom + (vertex.y - bottom) / squash, vertex.z * squash);
+      triangle.normals[k] = glm::normalize(glm::vec3(normal.x / squash, normal.y * squash, normal.z / squash));
+    }
+    glm::vec3 normal = rest.triangleNormal;
+    triangle.triangleNormal = glm::normalize(glm::vec3(normal.x / squash, normal.y * squash, normal.z / squash));
+  }
+  auto start = std::chrono::high_resolution_clock::now();
+  bool sphereRebuilt = sceneInstances.updateMesh(sphereMesh);
+  auto middle = std::chrono::high_resolution_clock::now();
+
+  //Spin the logo around its centre while it swings across the box
+  glm::vec3 centre = glm::vec3(logoTransform * glm::vec4(sceneInstances.meshes[logoMesh].bounds.centroid(), 1));
+  glm::vec3 swing(1.5f * sin(phase), 0, 1.5f * (1 - cos(phase)));
+  glm::mat4 transform = glm::translate(glm::mat4(1), centre + swing);
+  transform = glm::rotate(transform, 2 * phase, glm::vec3(0, 1, 0));
+  transform = glm::translate(transform, -centre) * logoTransform;
+  sceneInstances.setTransform(logoInstance, transform);
+  auto topStart = std::chrono::high_resolution_clock::now();
+  bool topRebuilt = sceneInstances.updateTopLevel();
+  auto end = std::chrono::high_resolution_clock::now();
+
+  //The rasteriser sees the squashed sphere too
+  modelTriangles = sceneInstances.flatten(0, baseInstances);
+  std::cout<<"Sphere BVH "<<(sphereRebuilt ? "rebuilt" : "refit")<<" in "
+           <<std::chrono::duration<double, std::milli>(middle - start).count()<<" ms, top level "
+           <<(topRebuilt ? "rebuilt" : "refit")<<" in "
+           <<std::chrono::duration<double, std::milli>(end - topStart).count()<<" ms"<<std::endl;
 }
 
 //Compute intersection
@@ -1149,28 +2496,116 @@ float getDistance(glm::vec3 p1, glm::vec3 p2) {
 // Mirror, glass
 // Ambient,diffuse,specular light
 // Soft shadows
-Colour directLight(RayTriangleIntersection input, std::vector<ModelTriangle> triangles, glm::vec3 rayDir) {
-  float check = std::numeric_limits<float>::max();
-  //CASE:Mirror found
-  if(input.triangleIndex == 10 || input.triangleIndex == 11) {
+Colour directLight(const RayTriangleIntersection& input, const SurfaceHit& surface, const SceneView& scene, glm::vec3 rayDir, int pixel) {
+  glm::vec3 nextOrigin, nextDir;
+  bool glass;
+  //CASE: Mirror or glass, follow the ray
+  if(bounceRay(input, surface, rayDir, nextOrigin, nextDir, glass)) {
+    if(!glass)
       isMirror = 1;
-      //Compute relfection's direction
-      glm::vec3 next_ray= getReflectedDirection(rayDir, input.intersectedTriangle.triangleNormal);
-      //Get reflection's intersection
-      RayTriangleIntersection closest = getClosestIntersection(triangles, next_ray, input.intersectionPoint );
-      //CASE:Intersection not found
-      if(closest.distanceFromCamera == check)
-        return  Colour(0, 0, 0);
-      //CASE:Intersection found
-      else
-			  return directLight(closest, triangles, next_ray);
+    //CASE: Too many bounces, stop before the stack runs out
+    if(bounceDepth >= maxBounceDepth)
+      return Colour(0, 0, 0);
+    RayTriangleIntersection closest = getClosestIntersection(scene, nextDir, nextOrigin);
+    //CASE:Intersection not found
+    if(!closest.found())
+      return  Colour(0, 0, 0);
+    bounceDepth++;
+    Colour colour = directLight(closest, resolveHit(scene, closest), scene, nextDir, pixel);
+    bounceDepth--;
+    //CASE: Glass brightens what is behind it
+    if(glass)
+      return Colour(colour.red*GLASS_MAGIC_NUMBER,colour.green*GLASS_MAGIC_NUMBER,colour.blue*GLASS_MAGIC_NUMBER);
+    return colour;
+  }
+
+  return shadeSurface(input, surface, scene, rayDir, pixel);
+}
+
+//Light at a surface point averaged over the pixel's light samples, with soft shadows
+Colour shadeSurface(const RayTriangleIntersection& input, const SurfaceHit& surface, const SceneView& scene, glm::vec3 rayDir, int pixel) {
+  glm::vec3 totalPixelIntensity = glm::vec3(0.f, 0.f, 0.f);
+  for(int i = 0; i < lightSampler.size(); i++) {
+    ShadowRay sample = lightSample(input, surface, rayDir, getLightPosition(pixel, i));
+    //CASE:Light is blocked -> do shadow
+    if(isOccluded(scene, sample.origin, sample.direction, sample.maxDistance))
+      totalPixelIntensity = totalPixelIntensity + sample.shadowed;
+    //CASE:Intersection not found -> do light
+    else
+      totalPixelIntensity = totalPixelIntensity + sample.lit;
   }
-  //CASE: Glass found
-  if(input.triangleIndex == 12 || input.triangleIndex == 13 || input.triangleIndex == 14 || input.triangleIndex == 15 || input.triangleIndex == 16 || input.triangleIndex == 17 || input.triangleIndex == 18 || input.triangleIndex == 19 || input.triangleIndex == 20 || input.triangleIndex == 21){
+   //Compute soft shadows
+   glm::vec3 avgPixelIntensity = totalPixelIntensity / (float) lightSampler.size();
+   Colour col = Colour(avgPixelIntensity.x,avgPixelIntensity.y,avgPixelIntensity.z);
+   return col;
+}
 
-      glm::vec3 surfaceNormal = input.intersectedTriangle.triangleNormal;
-      glm::vec3 direction = rayDir;
-      float currRefraction = GLASS_INDEX_OF_REFRACTION;
+//Shadow ray towards one light position, with the surface's colour when it is lit and when it is not
+ShadowRay lightSample(const RayTriangleIntersection& input, const SurfaceHit& surface, glm::vec3 rayDir, glm::vec3 light) {
+  const glm::vec3& intersectionPoint = surface.point;
+  const glm::vec3& normal = surface.normal;
+  const glm::vec3& colour = surface.colour;
+  ShadowRay sample;
+  //Calculate light's direction
+  glm::vec3 lightDir = light - intersectionPoint;
+  sample.maxDistance = glm::length(lightDir);
+  lightDir = glm::normalize(lightDir);
+  sample.origin = intersectionPoint + 0.001f*lightDir;
+  sample.direction = lightDir;
+  //Shadow
+  sample.shadowed = glm::vec3 (0.1*colour.x,
+                               0.1*colour.y,
+                               0.1*colour.z );
+  //Calculate diffuse light
+  float distance = getDistance(intersectionPoint,light);
+  float divisor = 4 * 3.14 * distance * distance;
+  float max = fmax(glm::dot(lightDir,normal),0);
+  float diffuse = (directLightPower*max/divisor);
+  //Calculate specular light
+  float specular = 0;
+  glm::vec3 reflection= getReflectedDirection(lightDir, normal);
+  reflection = glm::normalize(reflection);
+  double dot2 = glm::dot(reflection,rayDir);
+  const Material& material = materialTable[input.materialIndex];
+  if(material.surface == GLOSSY)
+     if(dot2 > 0)
+        specular = pow(dot2,material.shininess) * std::max(material.specular.x, std::max(material.specular.y, material.specular.z));
+
+  //Calculate brightness
+  float brightness = diffuse   + indirectLightPower + specular;
+
+  //Normalize brightness
+  if(brightness > 1)
+    brightness = 1;
+  else if(brightness < 0.2)
+    brightness = 0.2;
+  //Apply brightness
+  sample.lit = glm::vec3 (brightness*colour.x,
+                          brightness*colour.y,
+                          brightness*colour.z );
+  return sample;
+}
+
+//Next ray off a mirror or through glass, false for any other surface
+bool bounceRay(const RayTriangleIntersection& input, const SurfaceHit& surface, glm::vec3 rayDir, glm::vec3& origin, glm::vec3& direction, bool& glass) {
+  const Material& material = materialTable[input.materialIndex];
+  switch(material.surface) {
+    //CASE:Mirror found
+    case MIRROR: {
+      glass = false;
+      origin = surface.point;
+      //Compute relfection's direction
+      direction = getReflectedDirection(rayDir, surface.triangleNormal);
+      return true;
+    }
+    //CASE: Glass found
+    case GLASS: {
+      glass = true;
+      origin = surface.point;
+
+      glm::vec3 surfaceNormal = surface.triangleNormal;
+      direction = rayDir;
+      float currRefraction = material.refractiveIndex;
       // CASE: Inside glass object
       if(glm::dot(surfaceNormal, direction) > 0) {
         surfaceNormal *= -1.0f;
@@ -1192,73 +2627,11 @@ Colour directLight(RayTriangleIntersection input, std::vector<ModelTriangle> tri
         // Snell's law vector
         direction = normalize(direction + surfaceNormal * (cost1 * 2.0f));
       }
-
-     RayTriangleIntersection intersection = getClosestIntersection(triangles, direction, input.intersectionPoint );
-     // CASE: Intersection found
-     if(intersection.distanceFromCamera < check) {
-        Colour colour =  directLight(intersection,triangles,direction);
-        return Colour(colour.red*GLASS_MAGIC_NUMBER,colour.green*GLASS_MAGIC_NUMBER,colour.blue*GLASS_MAGIC_NUMBER);
-     }
-     // CASE: Intersection not found
-     else {
-        return  Colour(0, 0, 0);
-     }
-  }
-
-  glm::vec3  D;
-  glm::vec3 totalPixelIntensity = glm::vec3(0.f, 0.f, 0.f);
-  glm::vec3 light;
-  for(int i = 0; i < NUM_LIGHT_RAYS; i++) {
-    //Calculate light's direction
-    light = lightPositionArr[i];
-    glm::vec3 lightDir = light - input.intersectionPoint;
-    float dir_l = glm::length(lightDir);
-    lightDir = glm::normalize(lightDir);
-    //Get light's intersection
-    RayTriangleIntersection closest = getClosestIntersection(triangles, lightDir, input.intersectionPoint + 0.001f*lightDir);
-    //CASE:Intersection found -> do shadow
-    if ( closest.distanceFromCamera <= dir_l  ) {
-        D = glm::vec3 (0.1*input.intersectedTriangle.colour.red,
-                       0.1*input.intersectedTriangle.colour.green,
-                       0.1*input.intersectedTriangle.colour.blue );
+      return true;
     }
-    //CASE:Intersection not found -> do light
-    else {
-       //Calculate diffuse light
-       glm::vec3 normal = input.normal;
-       float distance = getDistance(input.intersectionPoint,light);
-       float divisor = 4 * 3.14 * distance * distance;
-       float max = fmax(glm::dot(lightDir,normal),0);
-       float diffuse = (directLightPower*max/divisor);
-       //Calculate specular light
-       float specular = 0;
-       glm::vec3 reflection= getReflectedDirection(lightDir, normal);
-       reflection = glm::normalize(reflection);
-       double dot2 = glm::dot(reflection,rayDir);
-       if(input.triangleIndex == 6 || input.triangleIndex == 7)
-          if(dot2 > 0)
-             specular = pow(dot2,256);
-
-       //Calculate brightness
-       float brightness = diffuse   + indirectLightPower + specular;
-
-       //Normalize brightness
-       if(brightness > 1)
-         brightness = 1;
-       else if(brightness < 0.2)
-         brightness = 0.2;
-       //Apply brightness
-       D = glm::vec3 (brightness*input.intersectedTriangle.colour.red,
-                      brightness*input.intersectedTriangle.colour.green,
-                      brightness*input.intersectedTriangle.colour.blue );
-       }
-
-       totalPixelIntensity = totalPixelIntensity + D;
-    }
-   //Compute soft shadows
-   glm::vec3 avgPixelIntensity = totalPixelIntensity / (float) NUM_LIGHT_RAYS;
-   Colour col = Colour(avgPixelIntensity.x,avgPixelIntensity.y,avgPixelIntensity.z);
-   return col;
+    default:
+      return false;
+  }
 }
 
 //Compute reflection's direction
@@ -1267,39 +2640,91 @@ glm::vec3 getReflectedDirection(const glm::vec3& incident, const glm::vec3& norm
   return reflected;
 }
 
+//Share of the light a mirror or glass surface passes on, its brightest colour channel
+float surfaceReflectance(const SurfaceHit& surface) {
+  return std::max(surface.colour.x, std::max(surface.colour.y, surface.colour.z)) / 255.f;
+}
+
 //Apply anti-aliasing
-void antiAliasing(std::vector<ModelTriangle> triangles) {
-	aliasedEdges->clear();
-	computePixelsIntensity();
-
-	// Compute edges
-	for (int y = 1; y < HEIGHT - 1; ++y) {
-	  for (int x = 1; x < WIDTH - 1; ++x) {
-			//CASE: Pixel is on an edge
-			if (sobelOperator(x, y) > SOBEL_THRESHOLD) {
-				// Store pixel
-				aliasedEdges->push_back(std::pair<int, int>(x, y));
-			}
-		}
- 	}
-  //Apply anti-aliasing on each edge
-	for (const std::pair<int, int>& p : *aliasedEdges) {
-    isMirror = 0;
-    //Apply supersampling
-    glm::vec3 color = supersamplingAA(p.first, p.second,triangles);
-    //CASE: Pixel is not mirror
-    if(!isMirror)
-      screen[p.first][p.second] = color;
-	}
+void antiAliasing(const SceneView& scene) {
+  auto start = std::chrono::high_resolution_clock::now();
+  //Luminance and edge bitmask, one task per row
+  scheduler->run(HEIGHT, [](int y) { computePixelsIntensity(y); });
+  scheduler->run(HEIGHT, [](int y) { sobelRow(y); });
+
+  //Compact the edges: each row writes its pixels after the edges of the rows above it
+  std::vector<int> rowOffsets(HEIGHT + 1, 0);
+  for(int y = 0; y < HEIGHT; y++) {
+    int count = 0;
+    for(int w = 0; w < EDGE_MASK_WORDS; w++)
+      count += __builtin_popcountll(edgeMask[y][w]);
+    rowOffsets[y + 1] = rowOffsets[y] + count;
+  }
+  aliasedEdges.resize(rowOffsets[HEIGHT]);
+  scheduler->run(HEIGHT, [&](int y) {
+    int next = rowOffsets[y];
+    for(int w = 0; w < EDGE_MASK_WORDS; w++) {
+      uint64_t bits = edgeMask[y][w];
+      while(bits) {
+        aliasedEdges[next++] = std::pair<int, int>(w * 64 + __builtin_ctzll(bits), y);
+        bits &= bits - 1;
+      }
+    }
+  });
+
+  //Apply supersampling on each edge, a pixel is only read and written by its own task
+  int edges = aliasedEdges.size();
+  scheduler->run((edges + EDGE_BATCH_SIZE - 1) / EDGE_BATCH_SIZE, [&](int batch) {
+    for(int e = batch * EDGE_BATCH_SIZE; e < std::min(edges, (batch + 1) * EDGE_BATCH_SIZE); e++) {
+      const std::pair<int, int>& p = aliasedEdges[e];
+      isMirror = 0;
+      glm::vec3 color = supersamplingAA(p.first, p.second, scene);
+      //CASE: Pixel is not mirror
+      if(!isMirror)
+        screen[p.first][p.second] = color;
+    }
+  });
+  auto end = std::chrono::high_resolution_clock::now();
+  std::cout<<"Supersampled "<<edges<<" edge pixels in "
+           <<std::chrono::duration<double, std::milli>(end - start).count()<<" ms"<<std::endl;
 }
 
-//Compute the pixel's intensity
-void computePixelsIntensity() {
-	for (int y = 1; y < HEIGHT - 1; ++y) {
-		for (int x = 1; x < WIDTH - 1; ++x) {
-			screenPixelsIntensity[y][x] = glm::dot(screen[y][x], INTENSITY_WEIGHTS);
-		}
-	}
+//Compute the pixels' intensity for one row
+void computePixelsIntensity(int y) {
+  for (int x = 0; x < WIDTH; ++x)
+    screenPixelsIntensity[y][x] = glm::dot(screen[x][y], INTENSITY_WEIGHTS);
+}
+
+//Mark the edge pixels of one row in the bitmask, several pixels at a time
+void sobelRow(int y) {
+  for(int w = 0; w < EDGE_MASK_WORDS; w++)
+    edgeMask[y][w] = 0;
+  if(y == 0 || y == HEIGHT - 1)
+    return;
+
+  const float* above = screenPixelsIntensity[y - 1];
+  const float* row = screenPixelsIntensity[y];
+  const float* below = screenPixelsIntensity[y + 1];
+  PacketFloat two = packetSet(2.0f);
+  PacketFloat threshold = packetSet(SOBEL_THRESHOLD);
+  int x = 1;
+  for(; x + PACKET_SIZE <= WIDTH - 1; x += PACKET_SIZE) {
+    PacketFloat aboveLeft = packetLoad(above + x - 1), aboveRight = packetLoad(above + x + 1);
+    PacketFloat belowLeft = packetLoad(below + x - 1), belowRight = packetLoad(below + x + 1);
+    PacketFloat top = packetAdd(packetAdd(aboveLeft, aboveRight), packetMul(two, packetLoad(above + x)));
+    PacketFloat bottom = packetAdd(packetAdd(belowLeft, belowRight), packetMul(two, packetLoad(below + x)));
+    PacketFloat right = packetAdd(packetAdd(aboveRight, belowRight), packetMul(two, packetLoad(row + x + 1)));
+    PacketFloat left = packetAdd(packetAdd(aboveLeft, belowLeft), packetMul(two, packetLoad(row + x - 1)));
+    PacketFloat gradient = packetAdd(packetAbs(packetSub(top, bottom)), packetAbs(packetSub(right, left)));
+    int mask = packetMask(packetLess(threshold, gradient));
+    for(int k = 0; mask; k++, mask >>= 1)
+      if(mask & 1)
+        edgeMask[y][(x + k) / 64] |= (uint64_t) 1 << ((x + k) % 64);
+  }
+  //Remaining pixels of the row
+  for(; x < WIDTH - 1; x++)
+    if(sobelOperator(x, y) > SOBEL_THRESHOLD)
+      edgeMask[y][x / 64] |= (uint64_t) 1 << (x % 64);
 }
 
 //Calculate sobel
@@ -1311,14 +2736,251 @@ float sobelOperator(int x, int y) {
 }
 
 //SuperSampling algorithm
-glm::vec3 supersamplingAA(int x, int y, std::vector<ModelTriangle> triangles) {
+glm::vec3 supersamplingAA(int x, int y, const SceneView& scene) {
 	glm::vec3 color = screen[x][y];
+  //The eight sub-pixel samples around the centre
+  float xs[8], ys[8];
+  int samples = 0;
   for (float x1 = x - 0.5; x1 < x + 1; x1 += 0.5) {
     for (float y1 = y - 0.5; y1 < y + 1; y1 += 0.5) {
 			if (x1 != x || y1 != y) {
-				color += traceRayFromCamera(x1, y1, triangles);
+				xs[samples] = x1;
+				ys[samples++] = y1;
 			}
 		}
 	}
+  //Trace them as packets
+  if(usePacketTracing) {
+    for(int k = 0; k < samples; k += PACKET_SIZE) {
+      glm::vec3 colours[PACKET_SIZE];
+      int count = std::min(PACKET_SIZE, samples - k);
+      tracePacketFromCamera(xs + k, ys + k, count, scene, colours);
+      for(int c = 0; c < count; c++)
+        color += colours[c];
+    }
+  }
+  else {
+    for(int k = 0; k < samples; k++)
+      color += traceRayFromCamera(xs[k], ys[k], scene);
+  }
 	return color / 9.0f;
 }
+////PATH TRACING
+//////////////////////////////////////////////////////////////////////////////////////////////////
+//Add one path per pixel to the running average and show the average.
+//Radiance is averaged before it is gamma corrected for the screen.
+void pathTracing(const SceneView& scene) {
+  auto start = std::chrono::high_resolution_clock::now();
+  //Set the camera orientation before the workers read it
+  orientationMatrix = RotationX * RotationY;
+  if(lock)
+     lookAt();
+  findEmitters(scene);
+  if(denoise)
+    denoiser->clearGuides();
+  if(accumulatedPasses == 0)
+    for(int i = 0; i < WIDTH; i++)
+      for(int j = 0; j < HEIGHT; j++)
+        accumulationBuffer[i][j] = glm::vec3(0, 0, 0);
+  accumulatedPasses++;
+  float weight = 1.0f / accumulatedPasses;
+
+  int tilesX = (WIDTH + TILE_SIZE - 1) / TILE_SIZE;
+  int tilesY = (HEIGHT + TILE_SIZE - 1) / TILE_SIZE;
+  scheduler->run(tilesX * tilesY, [&](int tile) {
+    int x0 = (tile % tilesX) * TILE_SIZE;
+    int y0 = (tile / tilesX) * TILE_SIZE;
+    for(int i = x0; i < std::min(x0 + TILE_SIZE, WIDTH); i++)
+      for(int j = y0; j < std::min(y0 + TILE_SIZE, HEIGHT); j++) {
+        Random random(i * HEIGHT + j, accumulatedPasses);
+        //Jitter the ray inside the pixel, the average over passes is anti-aliased
+        glm::vec3 dir = glm::vec3(i + random.uniform() - 0.5f - WIDTH/2, j + random.uniform() - 0.5f - HEIGHT/2, focalLength);
+        glm::vec3 radiance = tracePath(scene, cameraPos, orientationMatrix*glm::normalize(-dir), random, i * HEIGHT + j);
+        //CASE: Degenerate path, leave it out rather than spoil the pixel for good
+        if(std::isfinite(radiance.x + radiance.y + radiance.z))
+          accumulationBuffer[i][j] += radiance;
+        glm::vec3 average = accumulationBuffer[i][j] * weight;
+        screen[i][j] = 255.f * glm::min(glm::pow(average, glm::vec3(1 / DISPLAY_GAMMA)), glm::vec3(1));
+      }
+  });
+  auto end = std::chrono::high_resolution_clock::now();
+  std::cout<<"Path tracing pass "<<accumulatedPasses<<" in "
+           <<std::chrono::duration<double, std::milli>(end - start).count()<<" ms"<<std::endl;
+}
+
+//World space copies of every triangle with an emissive material, across the
+//instances in view, facing into their object, with the running total of their areas
+void findEmitters(const SceneView& scene) {
+  const InstancedScene& instanced = *scene.instances;
+  emitters.clear();
+  emitterAreas.clear();
+  emitterArea = 0;
+  for(int instance = 0; instance < scene.instanceCount; instance++) {
+    const Mesh& mesh = instanced.meshes[instanced.instances[instance].mesh];
+    for(int i = mesh.first; i < mesh.first + mesh.count; i++) {
+      //CASE: Material gives off no light
+      if(!materialTable[instanced.triangles[i].material].emissive())
+        continue;
+      ModelTriangle triangle = instanced.worldTriangle(instance, i);
+      triangle.triangleNormal = emitterNormal(scene, instance, triangle.triangleNormal, triangle.vertices[0]);
+      emitters.push_back(triangle);
+      emitterArea += 0.5f * glm::length(glm::cross(triangle.vertices[1] - triangle.vertices[0], triangle.vertices[2] - triangle.vertices[0]));
+      emitterAreas.push_back(emitterArea);
+    }
+  }
+}
+
+//Lights shine into the object they belong to, so their normal faces the centre of its bounds
+glm::vec3 emitterNormal(const SceneView& scene, int instance, glm::vec3 triangleNormal, glm::vec3 vertex) {
+  const AABB& bounds = scene.instances->instances[instance].bounds;
+  glm::vec3 centre = (bounds.min + bounds.max) * 0.5f;
+  if(glm::dot(triangleNormal, centre - vertex) < 0)
+    return -triangleNormal;
+  return triangleNormal;
+}
+
+//Radiance arriving along a ray. Diffuse surfaces take a light sample and a
+//cosine weighted bounce, both weighted with the power heuristic so the light
+//is counted once. Mirror and glass bounce without light samples, and Russian
+//roulette ends paths that carry little.
+glm::vec3 tracePath(const SceneView& scene, glm::vec3 origin, glm::vec3 direction, Random& random, int pixel) {
+  glm::vec3 radiance(0, 0, 0);
+  glm::vec3 throughput(1, 1, 1);
+  //Camera rays and specular bounces could not have been found by a light sample
+  bool specular = true;
+  float bouncePdf = 0;
+  for(int depth = 0; depth <= maxBounceDepth; depth++) {
+    RayTriangleIntersection hit = getClosestIntersection(scene, direction, origin);
+    //CASE: Intersection not found
+    if(!hit.found())
+      break;
+    SurfaceHit surface = resolveHit(scene, hit);
+    if(depth == 0 && denoise)
+      recordGuide(hit, surface, direction, pixel);
+    glm::vec3 point = surface.point;
+    glm::vec3 normal = surface.triangleNormal;
+    const Material& material = materialTable[hit.materialIndex];
+
+    //CASE: Light found, the path ends here
+    if(material.emissive()) {
+      glm::vec3 lightNormal = emitterNormal(scene, hit.instanceIndex, surface.triangleNormal, surface.vertex);
+      if(glm::dot(lightNormal, direction) < 0) {
+        float weight = specular ? 1 : powerHeuristic(bouncePdf, emitterPdf(origin, point, lightNormal));
+        radiance += throughput * material.emission * weight;
+      }
+      break;
+    }
+    switch(material.surface) {
+      //CASE: Mirror found
+      case MIRROR:
+        direction = getReflectedDirection(direction, normal);
+        specular = true;
+        break;
+      //CASE: Glass found
+      case GLASS:
+        direction = sampleGlass(direction, normal, material.refractiveIndex, random);
+        specular = true;
+        break;
+      //CASE: Diffuse surface, glossy ones bounce like diffuse here
+      default: {
+        if(glm::dot(normal, direction) > 0)
+          normal *= -1.0f;
+        glm::vec3 albedo = surface.colour / 255.f;
+        radiance += throughput * albedo * sampleEmitter(scene, point, normal, random);
+        //Cosine weighting cancels the cosine and 1/pi of the BRDF, only the albedo is left
+        direction = cosineDirection(normal, random.uniform(), random.uniform());
+        bouncePdf = glm::dot(normal, direction) / glm::pi<float>();
+        throughput *= albedo;
+        specular = false;
+      }
+    }
+    origin = point;
+
+    //Russian roulette, surviving paths carry the energy of the ended ones
+    if(depth >= ROULETTE_DEPTH) {
+      float survival = std::min(std::max(throughput.x, std::max(throughput.y, throughput.z)), 0.95f);
+      if(random.uniform() >= survival)
+        break;
+      throughput /= survival;
+    }
+  }
+  return radiance;
+}
+
+//Light reaching a diffuse point from a random point on the light, times the
+//cosine and 1/pi of the BRDF and weighted against finding it with a bounce
+glm::vec3 sampleEmitter(const SceneView& scene, glm::vec3 point, glm::vec3 normal, Random& random) {
+  //CASE: Nothing in the scene gives off light
+  if(emitters.empty() || emitterArea <= 0)
+    return glm::vec3(0, 0, 0);
+  //Pick a triangle by area, then a uniform point on it
+  float pick = random.uniform() * emitterArea;
+  int chosen = std::upper_bound(emitterAreas.begin(), emitterAreas.end(), pick) - emitterAreas.begin();
+  const ModelTriangle& emitter = emitters[std::min(chosen, (int) emitters.size() - 1)];
+  float root = std::sqrt(random.uniform());
+  float v = random.uniform() * root;
+  glm::vec3 lightPoint = emitter.vertices[0] + (1 - root)*(emitter.vertices[1] - emitter.vertices[0]) + v*(emitter.vertices[2] - emitter.vertices[0]);
+
+  glm::vec3 lightDir = lightPoint - point;
+  float distance = glm::length(lightDir);
+  lightDir /= distance;
+  float cosSurface = glm::dot(normal, lightDir);
+  //CASE: Light behind the surface or seen from above
+  if(cosSurface <= 0 || glm::dot(emitter.triangleNormal, lightDir) >= 0)
+    return glm::vec3(0, 0, 0);
+  //CASE: Light is blocked, stopping short of the light itself
+  if(isOccluded(scene, point, lightDir, distance - 0.001f))
+    return glm::vec3(0, 0, 0);
+  float lightPdf = emitterPdf(point, lightPoint, emitter.triangleNormal);
+  float bouncePdf = cosSurface / glm::pi<float>();
+  return materialTable[emitter.material].emission * (bouncePdf * powerHeuristic(lightPdf, bouncePdf) / lightPdf);
+}
+
+//Solid angle pdf of light sampling picking lightPoint as seen from origin
+float emitterPdf(glm::vec3 origin, glm::vec3 lightPoint, glm::vec3 lightNormal) {
+  //CASE: No light to sample, a bounce is the only way to find it
+  if(emitterArea <= 0)
+    return 0;
+  glm::vec3 lightDir = lightPoint - origin;
+  float distanceSquared = glm::dot(lightDir, lightDir);
+  float cosLight = std::fabs(glm::dot(lightNormal, lightDir)) / std::sqrt(distanceSquared);
+  return distanceSquared / (std::max(cosLight, 1e-6f) * emitterArea);
+}
+
+//Reflect or refract off glass, picked with the Fresnel term (Schlick)
+glm::vec3 sampleGlass(glm::vec3 direction, glm::vec3 normal, float refractiveIndex, Random& random) {
+  float ratio = 1 / refractiveIndex;
+  // CASE: Inside glass object
+  if(glm::dot(normal, direction) > 0) {
+    normal *= -1.0f;
+    ratio = refractiveIndex;
+  }
+  float cost1 = -glm::dot(normal, direction);
+  float cost2 = 1.0f - ratio * ratio * (1.0f - cost1 * cost1);
+  //CASE: Total internal reflection
+  if(cost2 <= 0)
+    return getReflectedDirection(direction, normal);
+  cost2 = std::sqrt(cost2);
+  //Schlick uses the angle on the outside of the glass
+  float r0 = (1 - refractiveIndex) / (1 + refractiveIndex);
+  r0 *= r0;
+  float fresnel = r0 + (1 - r0) * std::pow(1 - (ratio > 1 ? cost2 : cost1), 5.0f);
+  if(random.uniform() < fresnel)
+    return getReflectedDirection(direction, normal);
+  return glm::normalize(direction * ratio + normal * (ratio * cost1 - cost2));
+}
+
+//Direction around normal with probability proportional to the cosine
+glm::vec3 cosineDirection(glm::vec3 normal, float u1, float u2) {
+  glm::vec3 tangent = std::fabs(normal.x) > 0.9f ? glm::vec3(0, 1, 0) : glm::vec3(1, 0, 0);
+  tangent = glm::normalize(glm::cross(tangent, normal));
+  glm::vec3 bitangent = glm::cross(normal, tangent);
+  float radius = std::sqrt(u1);
+  float angle = 2 * glm::pi<float>() * u2;
+  return glm::normalize(tangent * (radius * std::cos(angle)) + bitangent * (radius * std::sin(angle)) + normal * std::sqrt(std::max(0.f, 1 - u1)));
+}
+
+//Power heuristic weight of a sample taken with pdf against one with otherPdf
+float powerHeuristic(float pdf, float otherPdf) {
+  return pdf * pdf / (pdf * pdf + otherPdf * otherPdf);
+}
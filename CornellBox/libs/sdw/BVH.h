@@ -0,0 +1,351 @@
+#pragma once
+#include <glm/glm.hpp>
+#include <vector>
+#include <algorithm>
+#include <limits>
+
+#define BVH_BINS 16
+#define BVH_MAX_LEAF_SIZE 4
+#define BVH_MAX_DEPTH 60
+#define BVH_STACK_SIZE 64
+#define BVH_TRAVERSAL_COST 1.0f
+#define BVH_INTERSECTION_COST 1.0f
+#define BVH_REFIT_LIMIT 1.5f
+
+class AABB
+{
+  public:
+    glm::vec3 min;
+    glm::vec3 max;
+
+    AABB()
+    {
+      min = glm::vec3(std::numeric_limits<float>::max());
+      max = glm::vec3(-std::numeric_limits<float>::max());
+    }
+
+    AABB(glm::vec3 boxMin, glm::vec3 boxMax)
+    {
+      min = boxMin;
+      max = boxMax;
+    }
+
+    void grow(const glm::vec3& point)
+    {
+      min = glm::min(min, point);
+      max = glm::max(max, point);
+    }
+
+    void grow(const AABB& box)
+    {
+      min = glm::min(min, box.min);
+      max = glm::max(max, box.max);
+    }
+
+    glm::vec3 centroid() const
+    {
+      return (min + max) * 0.5f;
+    }
+
+    // Half of the surface area, which is all the SAH needs
+    float area() const
+    {
+      glm::vec3 extent = max - min;
+      if(extent.x < 0 || extent.y < 0 || extent.z < 0)
+        return 0;
+      return extent.x * extent.y + extent.y * extent.z + extent.z * extent.x;
+    }
+
+    // Slab test, returns the entry distance or infinity on a miss
+    float intersect(const glm::vec3& origin, const glm::vec3& invDir, float tMax) const
+    {
+      glm::vec3 t0 = (min - origin) * invDir;
+      glm::vec3 t1 = (max - origin) * invDir;
+      glm::vec3 tNear = glm::min(t0, t1);
+      glm::vec3 tFar = glm::max(t0, t1);
+      float tEnter = std::max(std::max(tNear.x, tNear.y), tNear.z);
+      float tExit = std::min(std::min(tFar.x, tFar.y), tFar.z);
+      if(tExit >= tEnter && tExit >= 0 && tEnter <= tMax)
+        return tEnter;
+      return std::numeric_limits<float>::infinity();
+    }
+};
+
+// Interior nodes store the index of their left child in leftFirst (the right
+// child follows it), leaves store the first entry of primitiveIndices.
+class BVHNode
+{
+  public:
+    AABB bounds;
+    int leftFirst;
+    int count;
+
+    bool isLeaf() const
+    {
+      return count > 0;
+    }
+};
+
+// Bounding volume hierarchy built with the binned surface area heuristic
+class BVH
+{
+  public:
+    std::vector<BVHNode> nodes;
+    std::vector<int> primitiveIndices;
+    float builtCost;
+
+    BVH()
+    {
+      builtCost = 0;
+    }
+
+    void build(const std::vector<AABB>& primitiveBounds)
+    {
+      nodes.clear();
+      primitiveIndices.resize(primitiveBounds.size());
+      for(int i = 0; i < (int) primitiveBounds.size(); i++)
+        primitiveIndices[i] = i;
+      if(primitiveBounds.empty())
+        return;
+
+      centroids.resize(primitiveBounds.size());
+      for(int i = 0; i < (int) primitiveBounds.size(); i++)
+        centroids[i] = primitiveBounds[i].centroid();
+
+      nodes.reserve(2 * primitiveBounds.size());
+      BVHNode root;
+      root.leftFirst = 0;
+      root.count = primitiveBounds.size();
+      nodes.push_back(root);
+      updateBounds(0, primitiveBounds);
+      subdivide(0, primitiveBounds, 0);
+      centroids.clear();
+      builtCost = cost();
+    }
+
+    // Update the node bounds bottom up after the primitives moved, keeping the
+    // tree as it is. Children are always stored after their parent.
+    void refit(const std::vector<AABB>& primitiveBounds)
+    {
+      for(int i = nodes.size() - 1; i >= 0; i--) {
+        BVHNode& node = nodes[i];
+        if(node.isLeaf()) {
+          updateBounds(i, primitiveBounds);
+        }
+        else {
+          node.bounds = nodes[node.leftFirst].bounds;
+          node.bounds.grow(nodes[node.leftFirst + 1].bounds);
+        }
+      }
+    }
+
+    // SAH cost of the whole tree relative to the area of its root
+    float cost() const
+    {
+      if(nodes.empty())
+        return 0;
+      float total = 0;
+      for(int i = 0; i < (int) nodes.size(); i++) {
+        if(nodes[i].isLeaf())
+          total += BVH_INTERSECTION_COST * nodes[i].count * nodes[i].bounds.area();
+        else
+          total += BVH_TRAVERSAL_COST * nodes[i].bounds.area();
+      }
+      return total / std::max(nodes[0].bounds.area(), 1e-12f);
+    }
+
+    // True once refits made the tree noticeably slower than a fresh build
+    bool degraded() const
+    {
+      return cost() > BVH_REFIT_LIMIT * builtCost;
+    }
+
+    int size() const
+    {
+      return primitiveIndices.size();
+    }
+
+    // Visit the leaves a ray reaches, nearest first. visitLeaf(first, count)
+    // gets a range of primitiveIndices and may shrink tMax, which skips the
+    // nodes that are entered beyond it.
+    template<typename Visitor>
+    void traverseClosest(const glm::vec3& origin, const glm::vec3& dir, const float& tMax, Visitor visitLeaf) const
+    {
+      if(nodes.empty())
+        return;
+      glm::vec3 invDir = 1.0f / dir;
+      int stack[BVH_STACK_SIZE];
+      float stackDist[BVH_STACK_SIZE];
+      int stackSize = 0;
+      float rootDist = nodes[0].bounds.intersect(origin, invDir, tMax);
+      if(rootDist != std::numeric_limits<float>::infinity()) {
+        stack[stackSize] = 0;
+        stackDist[stackSize++] = rootDist;
+      }
+
+      while(stackSize > 0) {
+        stackSize--;
+        if(stackDist[stackSize] > tMax)
+          continue;
+        const BVHNode& node = nodes[stack[stackSize]];
+        if(node.isLeaf()) {
+          visitLeaf(node.leftFirst, node.count);
+          continue;
+        }
+        int nearChild = node.leftFirst;
+        int farChild = node.leftFirst + 1;
+        float nearDist = nodes[nearChild].bounds.intersect(origin, invDir, tMax);
+        float farDist = nodes[farChild].bounds.intersect(origin, invDir, tMax);
+        if(farDist < nearDist) {
+          std::swap(nearChild, farChild);
+          std::swap(nearDist, farDist);
+        }
+        if(farDist != std::numeric_limits<float>::infinity()) {
+          stack[stackSize] = farChild;
+          stackDist[stackSize++] = farDist;
+        }
+        if(nearDist != std::numeric_limits<float>::infinity()) {
+          stack[stackSize] = nearChild;
+          stackDist[stackSize++] = nearDist;
+        }
+      }
+    }
+
+    // Visit the leaves a ray reaches in any order until visitLeaf(first, count)
+    // returns true, returns whether one did
+    template<typename Visitor>
+    bool traverseAny(const glm::vec3& origin, const glm::vec3& dir, float tMax, Visitor visitLeaf) const
+    {
+      if(nodes.empty())
+        return false;
+      glm::vec3 invDir = 1.0f / dir;
+      int stack[BVH_STACK_SIZE];
+      int stackSize = 0;
+      stack[stackSize++] = 0;
+      while(stackSize > 0) {
+        const BVHNode& node = nodes[stack[--stackSize]];
+        if(node.bounds.intersect(origin, invDir, tMax) == std::numeric_limits<float>::infinity())
+          continue;
+        if(node.isLeaf()) {
+          if(visitLeaf(node.leftFirst, node.count))
+            return true;
+        }
+        else {
+          stack[stackSize++] = node.leftFirst + 1;
+          stack[stackSize++] = node.leftFirst;
+        }
+      }
+      return false;
+    }
+
+  private:
+    std::vector<glm::vec3> centroids;
+
+    void updateBounds(int nodeIndex, const std::vector<AABB>& primitiveBounds)
+    {
+      BVHNode& node = nodes[nodeIndex];
+      node.bounds = AABB();
+      for(int i = node.leftFirst; i < node.leftFirst + node.count; i++)
+        node.bounds.grow(primitiveBounds[primitiveIndices[i]]);
+    }
+
+    // Pick the cheapest split plane by binning primitive centroids
+    float findBestSplit(const BVHNode& node, const std::vector<AABB>& primitiveBounds, int& bestAxis, float& bestPosition)
+    {
+      float bestCost = std::numeric_limits<float>::max();
+      AABB centroidBounds;
+      for(int i = node.leftFirst; i < node.leftFirst + node.count; i++)
+        centroidBounds.grow(centroids[primitiveIndices[i]]);
+
+      for(int axis = 0; axis < 3; axis++) {
+        float boundsMin = centroidBounds.min[axis];
+        float boundsMax = centroidBounds.max[axis];
+        if(boundsMin == boundsMax)
+          continue;
+
+        AABB binBounds[BVH_BINS];
+        int binCount[BVH_BINS] = {0};
+        float scale = BVH_BINS / (boundsMax - boundsMin);
+        for(int i = node.leftFirst; i < node.leftFirst + node.count; i++) {
+          int primitive = primitiveIndices[i];
+          int bin = std::min(BVH_BINS - 1, (int) ((centroids[primitive][axis] - boundsMin) * scale));
+          binCount[bin]++;
+          binBounds[bin].grow(primitiveBounds[primitive]);
+        }
+
+        // Sweep the bins from both sides to get the cost of every plane
+        float leftArea[BVH_BINS - 1], rightArea[BVH_BINS - 1];
+        int leftCount[BVH_BINS - 1], rightCount[BVH_BINS - 1];
+        AABB leftBox, rightBox;
+        int leftSum = 0, rightSum = 0;
+        for(int i = 0; i < BVH_BINS - 1; i++) {
+          leftSum += binCount[i];
+          leftCount[i] = leftSum;
+          leftBox.grow(binBounds[i]);
+          leftArea[i] = leftBox.area();
+          rightSum += binCount[BVH_BINS - 1 - i];
+          rightCount[BVH_BINS - 2 - i] = rightSum;
+          rightBox.grow(binBounds[BVH_BINS - 1 - i]);
+          rightArea[BVH_BINS - 2 - i] = rightBox.area();
+        }
+
+        float binWidth = (boundsMax - boundsMin) / BVH_BINS;
+        for(int i = 0; i < BVH_BINS - 1; i++) {
+          float cost = leftCount[i] * leftArea[i] + rightCount[i] * rightArea[i];
+          if(leftCount[i] > 0 && rightCount[i] > 0 && cost < bestCost) {
+            bestCost = cost;
+            bestAxis = axis;
+            bestPosition = boundsMin + binWidth * (i + 1);
+          }
+        }
+      }
+      return bestCost;
+    }
+
+    void subdivide(int nodeIndex, const std::vector<AABB>& primitiveBounds, int depth)
+    {
+      if(depth >= BVH_MAX_DEPTH)
+        return;
+      int axis = 0;
+      float position = 0;
+      float splitCost = findBestSplit(nodes[nodeIndex], primitiveBounds, axis, position);
+
+      // Stop when splitting costs more than intersecting every primitive
+      float leafCost = BVH_INTERSECTION_COST * nodes[nodeIndex].count;
+      float nodeArea = nodes[nodeIndex].bounds.area();
+      float splitTotal = BVH_TRAVERSAL_COST + BVH_INTERSECTION_COST * splitCost / std::max(nodeArea, 1e-12f);
+      if(splitCost == std::numeric_limits<float>::max()
+          || (nodes[nodeIndex].count <= BVH_MAX_LEAF_SIZE && splitTotal >= leafCost))
+        return;
+
+      // Partition the primitive indices around the split plane
+      int first = nodes[nodeIndex].leftFirst;
+      int i = first;
+      int j = first + nodes[nodeIndex].count - 1;
+      while(i <= j) {
+        if(centroids[primitiveIndices[i]][axis] < position)
+          i++;
+        else
+          std::swap(primitiveIndices[i], primitiveIndices[j--]);
+      }
+      int leftCount = i - first;
+      if(leftCount == 0 || leftCount == nodes[nodeIndex].count)
+        return;
+
+      int leftChild = nodes.size();
+      BVHNode left, right;
+      left.leftFirst = first;
+      left.count = leftCount;
+      right.leftFirst = i;
+      right.count = nodes[nodeIndex].count - leftCount;
+      nodes.push_back(left);
+      nodes.push_back(right);
+      nodes[nodeIndex].leftFirst = leftChild;
+      nodes[nodeIndex].count = 0;
+
+      updateBounds(leftChild, primitiveBounds);
+      updateBounds(leftChild + 1, primitiveBounds);
+      subdivide(leftChild, primitiveBounds, depth + 1);
+      subdivide(leftChild + 1, primitiveBounds, depth + 1);
+    }
+};
@@ -0,0 +1,36 @@
+#pragma once
+#include <tuple>
+
+// What a cached buffer was last filled for, e.g. the camera and the version
+// of the scene as a std::tuple. The buffer matches a key only while it is
+// filled and was filled for an equal key, so a buffer that is being
+// overwritten is invalidated first.
+template<typename Key>
+class CacheKey
+{
+  public:
+    CacheKey()
+    {
+      filled = false;
+    }
+
+    void invalidate()
+    {
+      filled = false;
+    }
+
+    void fill(const Key& key)
+    {
+      current = key;
+      filled = true;
+    }
+
+    bool matches(const Key& key) const
+    {
+      return filled && current == key;
+    }
+
+  private:
+    bool filled;
+    Key current;
+};
@@ -11,6 +11,8 @@ class CanvasPoint
     float brightness;
     TexturePoint texturePoint;
     glm::vec3 pos3d;
+    // Barycentric point on the source triangle times depth, for lightmap lookups
+    glm::vec2 lightmapPoint;
 
     CanvasPoint()
     {
@@ -7,9 +7,12 @@ class CanvasTriangle
   public:
     CanvasPoint vertices[3];
     Colour colour;
+    // Index of the model triangle it was projected from, -1 when not known
+    int triangleIndex;
 
     CanvasTriangle()
     {
+      triangleIndex = -1;
     }
 
     CanvasTriangle(CanvasPoint v0, CanvasPoint v1, CanvasPoint v2)
@@ -18,6 +21,7 @@ class CanvasTriangle
       vertices[1] = v1;
       vertices[2] = v2;
       colour = Colour(255,255,255);
+      triangleIndex = -1;
     }
 
     CanvasTriangle(CanvasPoint v0, CanvasPoint v1, CanvasPoint v2, Colour c)
@@ -26,6 +30,7 @@ class CanvasTriangle
       vertices[1] = v1;
       vertices[2] = v2;
       colour = c;
+      triangleIndex = -1;
     }
 
 };
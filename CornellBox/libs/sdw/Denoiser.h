@@ -0,0 +1,225 @@
+#pragma once
+#include <glm/glm.hpp>
+#include <vector>
+#include <algorithm>
+#include <cmath>
+#include "TileScheduler.h"
+
+#define DENOISE_ITERATIONS 5
+#define DENOISE_SIGMA_LUMINANCE 4.f
+#define DENOISE_SIGMA_NORMAL 0.3f
+#define DENOISE_SIGMA_DEPTH 0.01f
+#define DENOISE_MIN_ALBEDO 0.01f
+
+// Edge-avoiding a-trous wavelet filter for frames traced with few samples.
+// Every iteration blurs with a 5x5 B3 spline kernel whose taps lie 2^i pixels
+// apart, and each tap is weighted down where its normal or depth differs from
+// the centre pixel, or its luminance by more than the noise there explains.
+// The noise starts as the luminance variance around each pixel and is
+// filtered along with the colour. Lighting is filtered with the albedo divided
+// out, so material edges stay sharp however far the taps reach.
+// All buffers are flat arrays indexed x * height + y like the screen, so the
+// inner loops walk contiguous memory and vectorise.
+class Denoiser
+{
+  public:
+    Denoiser(int screenWidth, int screenHeight)
+    {
+      width = screenWidth;
+      height = screenHeight;
+      int pixels = width * height;
+      depth.resize(pixels);
+      inverseDepth.resize(pixels);
+      valid.resize(pixels);
+      variance.resize(pixels);
+      filteredVariance.resize(pixels);
+      for(int c = 0; c < 3; c++) {
+        normal[c].resize(pixels);
+        albedo[c].resize(pixels);
+        colour[c].resize(pixels);
+        filtered[c].resize(pixels);
+      }
+      clearGuides();
+    }
+
+    // Forget the guides of the last frame, pixels that get none are left alone
+    void clearGuides()
+    {
+      std::fill(valid.begin(), valid.end(), 0.f);
+      std::fill(depth.begin(), depth.end(), 0.f);
+      std::fill(inverseDepth.begin(), inverseDepth.end(), 0.f);
+      for(int c = 0; c < 3; c++) {
+        std::fill(normal[c].begin(), normal[c].end(), 0.f);
+        std::fill(albedo[c].begin(), albedo[c].end(), 1.f);
+      }
+    }
+
+    // Guide of a pixel from its primary hit: distance, unit normal and albedo in [0, 1]
+    void setGuide(int pixel, float distance, const glm::vec3& surfaceNormal, const glm::vec3& surfaceAlbedo)
+    {
+      valid[pixel] = 1;
+      depth[pixel] = distance;
+      inverseDepth[pixel] = 1 / distance;
+      for(int c = 0; c < 3; c++) {
+        normal[c][pixel] = surfaceNormal[c];
+        albedo[c][pixel] = std::max(surfaceAlbedo[c], DENOISE_MIN_ALBEDO);
+      }
+    }
+
+    // Filter pixels (width * height colours in 0-255) in place
+    void filter(glm::vec3* pixels, TileScheduler& scheduler)
+    {
+      //Divide the albedo out
+      scheduler.run(width, [&](int x) {
+        for(int p = x * height; p < (x + 1) * height; p++)
+          for(int c = 0; c < 3; c++)
+            colour[c][p] = pixels[p][c] / albedo[c][p];
+      });
+      scheduler.run(width, [&](int x) {
+        estimateVariance(x);
+      });
+      for(int i = 0; i < DENOISE_ITERATIONS; i++) {
+        int step = 1 << i;
+        float depthScale = 1 / (DENOISE_SIGMA_DEPTH * DENOISE_SIGMA_DEPTH * step * step);
+        scheduler.run(width, [&](int x) {
+          filterColumn(x, step, depthScale);
+        });
+        for(int c = 0; c < 3; c++)
+          colour[c].swap(filtered[c]);
+        variance.swap(filteredVariance);
+      }
+      //Multiply the albedo back in
+      scheduler.run(width, [&](int x) {
+        for(int p = x * height; p < (x + 1) * height; p++)
+          if(valid[p] > 0)
+            for(int c = 0; c < 3; c++)
+              pixels[p][c] = colour[c][p] * albedo[c][p];
+      });
+    }
+
+  private:
+    int width;
+    int height;
+    std::vector<float> depth;
+    std::vector<float> inverseDepth;
+    std::vector<float> valid;
+    std::vector<float> variance;
+    std::vector<float> filteredVariance;
+    std::vector<float> normal[3];
+    std::vector<float> albedo[3];
+    std::vector<float> colour[3];
+    std::vector<float> filtered[3];
+
+    // Running sums of one column, kept per worker thread so columns filtered
+    // at the same time never share them and no column allocates its own
+    class ColumnSums
+    {
+      public:
+        std::vector<float> colour[3];
+        std::vector<float> weights;
+        std::vector<float> variance;
+        std::vector<float> luminanceScale;
+    };
+
+    static float luminance(float r, float g, float b)
+    {
+      return 0.2126f * r + 0.7152f * g + 0.0722f * b;
+    }
+
+    // Luminance variance over the 3x3 pixels around each pixel of column x that were hit
+    void estimateVariance(int x)
+    {
+      for(int y = 0; y < height; y++) {
+        float sum = 0, sumSquares = 0, count = 0;
+        for(int i = std::max(0, x - 1); i <= std::min(width - 1, x + 1); i++)
+          for(int j = std::max(0, y - 1); j <= std::min(height - 1, y + 1); j++) {
+            int q = i * height + j;
+            float l = luminance(colour[0][q], colour[1][q], colour[2][q]);
+            sum += valid[q] * l;
+            sumSquares += valid[q] * l * l;
+            count += valid[q];
+          }
+        float mean = sum / std::max(count, 1.f);
+        variance[x * height + y] = std::max(sumSquares / std::max(count, 1.f) - mean * mean, 0.f);
+      }
+    }
+
+    // One iteration over column x: every tap is a run of contiguous pixels
+    void filterColumn(int x, int step, float depthScale)
+    {
+      const float kernel[5] = {1 / 16.f, 1 / 4.f, 3 / 8.f, 1 / 4.f, 1 / 16.f};
+      const float normalScale = 1 / (DENOISE_SIGMA_NORMAL * DENOISE_SIGMA_NORMAL);
+      //Assigning keeps the capacity, only the first column of a thread allocates
+      static thread_local ColumnSums sums;
+      for(int c = 0; c < 3; c++)
+        sums.colour[c].assign(height, 0.f);
+      sums.weights.assign(height, 0.f);
+      sums.variance.assign(height, 0.f);
+      sums.luminanceScale.resize(height);
+      std::vector<float>& luminanceScale = sums.luminanceScale;
+      int centre = x * height;
+      //Luminance differences count in units of the noise at the centre pixel
+      for(int y = 0; y < height; y++)
+        luminanceScale[y] = 1 / (DENOISE_SIGMA_LUMINANCE * std::sqrt(variance[centre + y]) + 1e-3f);
+      //The centre column and its guides
+      const float *r = colour[0].data() + centre, *g = colour[1].data() + centre, *b = colour[2].data() + centre;
+      const float *nx = normal[0].data() + centre, *ny = normal[1].data() + centre, *nz = normal[2].data() + centre;
+      const float *z = depth.data() + centre, *invZ = inverseDepth.data() + centre, *centreValid = valid.data() + centre;
+      const float *lScale = luminanceScale.data();
+      float *sumR = sums.colour[0].data(), *sumG = sums.colour[1].data(), *sumB = sums.colour[2].data(), *sumW = sums.weights.data(), *sumV = sums.variance.data();
+
+      for(int i = 0; i < 5; i++) {
+        int tapX = x + (i - 2) * step;
+        //CASE: Tap column off the screen
+        if(tapX < 0 || tapX >= width)
+          continue;
+        for(int j = 0; j < 5; j++) {
+          int offset = (j - 2) * step;
+          int first = std::max(0, -offset);
+          int last = std::min(height, height - offset);
+          //The tap column shifted so that index y is the tap of centre pixel y
+          int tap = tapX * height + offset;
+          const float *tr = colour[0].data() + tap, *tg = colour[1].data() + tap, *tb = colour[2].data() + tap;
+          const float *tnx = normal[0].data() + tap, *tny = normal[1].data() + tap, *tnz = normal[2].data() + tap;
+          const float *tz = depth.data() + tap, *tValid = valid.data() + tap, *tVariance = variance.data() + tap;
+          float tapWeight = kernel[i] * kernel[j];
+          //The sums are only written through their own pointers, no aliasing checks needed
+#pragma GCC ivdep
+          for(int y = first; y < last; y++) {
+            float dLuminance = std::fabs(luminance(r[y], g[y], b[y]) - luminance(tr[y], tg[y], tb[y]));
+            float dx = nx[y] - tnx[y], dy = ny[y] - tny[y], dz = nz[y] - tnz[y];
+            float dDepth = (z[y] - tz[y]) * invZ[y];
+            float distance = dLuminance * lScale[y] + (dx*dx + dy*dy + dz*dz) * normalScale + dDepth*dDepth * depthScale;
+            float weight = tapWeight * tValid[y] * fastExp(-distance);
+            sumR[y] += weight * tr[y];
+            sumG[y] += weight * tg[y];
+            sumB[y] += weight * tb[y];
+            sumW[y] += weight;
+            sumV[y] += weight * weight * tVariance[y];
+          }
+        }
+      }
+      float *outR = filtered[0].data() + centre, *outG = filtered[1].data() + centre, *outB = filtered[2].data() + centre;
+      float *outV = filteredVariance.data() + centre;
+      const float *centreVariance = variance.data() + centre;
+#pragma GCC ivdep
+      for(int y = 0; y < height; y++) {
+        //CASE: Nothing hit, keep the pixel
+        bool keep = centreValid[y] == 0;
+        outR[y] = keep ? r[y] : sumR[y] / sumW[y];
+        outG[y] = keep ? g[y] : sumG[y] / sumW[y];
+        outB[y] = keep ? b[y] : sumB[y] / sumW[y];
+        outV[y] = keep ? centreVariance[y] : sumV[y] / (sumW[y] * sumW[y]);
+      }
+    }
+
+    // exp(x) for x <= 0 as (1 + x/256)^256, branch free so the loop vectorises
+    static float fastExp(float x)
+    {
+      float result = 1 + x * (1 / 256.f);
+      result = result > 0 ? result : 0;
+      for(int i = 0; i < 8; i++)
+        result *= result;
+      return result;
+    }
+};
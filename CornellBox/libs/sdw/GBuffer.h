@@ -0,0 +1,47 @@
+#pragma once
+#include <glm/glm.hpp>
+#include <vector>
+#include "RayTriangleIntersection.h"
+#include "SurfaceHit.h"
+#include "CacheKey.h"
+
+// Primary hit of every pixel of the last ray traced frame, with the surface
+// its shading reads. While the camera and the scene stay as they were, a new
+// frame only redoes the lighting from here instead of tracing camera rays.
+class GBuffer
+{
+  public:
+    std::vector<RayTriangleIntersection> hits;
+    std::vector<SurfaceHit> surfaces;
+    // 1 where the surface is shaded directly, 0 for misses, back faces,
+    // mirrors and glass, which go through the full shading from the hit
+    std::vector<unsigned char> direct;
+
+    GBuffer(int pixels)
+    {
+      hits.resize(pixels);
+      surfaces.resize(pixels);
+      direct.resize(pixels);
+    }
+
+    // Drop the frame before overwriting it
+    void invalidate()
+    {
+      key.invalidate();
+    }
+
+    // Every pixel was written for the camera at cameraPos turned by orientation
+    // in the given version of the scene
+    void fill(const glm::vec3& cameraPos, const glm::mat3& orientation, int sceneVersion)
+    {
+      key.fill(std::make_tuple(cameraPos, orientation, sceneVersion));
+    }
+
+    bool matches(const glm::vec3& cameraPos, const glm::mat3& orientation, int sceneVersion) const
+    {
+      return key.matches(std::make_tuple(cameraPos, orientation, sceneVersion));
+    }
+
+  private:
+    CacheKey<std::tuple<glm::vec3, glm::mat3, int>> key;
+};
@@ -0,0 +1,218 @@
+#pragma once
+#include <glm/glm.hpp>
+#include <vector>
+#include "ModelTriangle.h"
+#include "BVH.h"
+#include "WideBVH.h"
+#include "TriangleStore.h"
+#include "SurfaceHit.h"
+
+// A mesh is a contiguous range of the object space triangle list with its
+// own bottom level BVH and intersection store, built once when it is added.
+// Store slots map back to indices of the whole triangle list. The wide BVH
+// is the same tree collapsed for single rays.
+class Mesh
+{
+  public:
+    int first;
+    int count;
+    BVH bvh;
+    WideBVH wideBvh;
+    TriangleStore store;
+    AABB bounds;
+};
+
+// One placement of a mesh. Rays are moved into object space with inverse,
+// directions are not renormalised so hit distances stay the same in both spaces.
+class Instance
+{
+  public:
+    int mesh;
+    glm::mat4 transform;
+    glm::mat4 inverse;
+    glm::mat3 normalMatrix;
+    AABB bounds;
+};
+
+// Two level acceleration structure: meshes are stored once in object space
+// and the top level BVH is built over the world bounds of their instances.
+// Moving an instance only needs buildTopLevel().
+class InstancedScene
+{
+  public:
+    std::vector<ModelTriangle> triangles;
+    std::vector<int> materials;
+    std::vector<Mesh> meshes;
+    std::vector<Instance> instances;
+    BVH topLevel;
+    WideBVH wideTopLevel;
+    // Counts every change to the meshes or instances, so caches of what the
+    // scene looked like can tell they are stale
+    int version;
+
+    InstancedScene()
+    {
+      version = 0;
+    }
+
+    // Append an object space mesh (with its normals already set) and build its BVH
+    int addMesh(const std::vector<ModelTriangle>& meshTriangles, const std::vector<int>& meshMaterials)
+    {
+      Mesh mesh;
+      mesh.first = triangles.size();
+      mesh.count = meshTriangles.size();
+      triangles.insert(triangles.end(), meshTriangles.begin(), meshTriangles.end());
+      materials.insert(materials.end(), meshMaterials.begin(), meshMaterials.end());
+      meshes.push_back(mesh);
+      buildMesh(meshes.size() - 1, true);
+      return meshes.size() - 1;
+    }
+
+    // Catch up with triangles of a mesh that moved in object space: the BVH is
+    // refitted, or rebuilt once the refits degraded it. Returns true on a rebuild.
+    bool updateMesh(int mesh)
+    {
+      bool rebuilt = buildMesh(mesh, false);
+      //Every instance of the mesh has new world bounds
+      for(int i = 0; i < (int) instances.size(); i++)
+        if(instances[i].mesh == mesh)
+          setTransform(i, instances[i].transform);
+      return rebuilt;
+    }
+
+    int addInstance(int mesh, const glm::mat4& transform)
+    {
+      instances.push_back(Instance());
+      instances.back().mesh = mesh;
+      setTransform(instances.size() - 1, transform);
+      return instances.size() - 1;
+    }
+
+    // Place an instance, the top level has to be rebuilt afterwards
+    void setTransform(int instance, const glm::mat4& transform)
+    {
+      Instance& placed = instances[instance];
+      version++;
+      placed.transform = transform;
+      placed.inverse = glm::inverse(transform);
+      placed.normalMatrix = glm::transpose(glm::mat3(placed.inverse));
+      //World bounds from the eight corners of the object space bounds
+      const AABB& local = meshes[placed.mesh].bounds;
+      placed.bounds = AABB();
+      for(int corner = 0; corner < 8; corner++) {
+        glm::vec3 point((corner & 1) ? local.max.x : local.min.x,
+                        (corner & 2) ? local.max.y : local.min.y,
+                        (corner & 4) ? local.max.z : local.min.z);
+        placed.bounds.grow(glm::vec3(transform * glm::vec4(point, 1)));
+      }
+    }
+
+    void buildTopLevel()
+    {
+      topLevel.build(instanceBounds());
+      wideTopLevel.build(topLevel);
+    }
+
+    // Catch up with instances that moved, refitting the top level or rebuilding
+    // it once it degraded. Returns true on a rebuild.
+    bool updateTopLevel()
+    {
+      std::vector<AABB> bounds = instanceBounds();
+      topLevel.refit(bounds);
+      bool rebuild = topLevel.degraded();
+      if(rebuild)
+        topLevel.build(bounds);
+      wideTopLevel.build(topLevel);
+      return rebuild;
+    }
+
+    void removeInstances(int first)
+    {
+      instances.resize(first);
+      version++;
+    }
+
+    // Triangle of an instance moved to world space
+    ModelTriangle worldTriangle(int instance, int triangle) const
+    {
+      const Instance& placed = instances[instance];
+      return transformTriangle(triangles[triangle], placed.transform, placed.normalMatrix);
+    }
+
+    // Surface at barycentric (u, v) of a triangle of an instance, in world space
+    SurfaceHit surfaceHit(int instance, int triangle, float u, float v) const
+    {
+      const Instance& placed = instances[instance];
+      const ModelTriangle& local = triangles[triangle];
+      glm::vec3 vertices[3], normals[3];
+      for(int k = 0; k < 3; k++) {
+        vertices[k] = glm::vec3(placed.transform * glm::vec4(local.vertices[k], 1));
+        normals[k] = glm::normalize(placed.normalMatrix * local.normals[k]);
+      }
+      SurfaceHit hit;
+      hit.point = vertices[0] + u*(vertices[1] - vertices[0]) + v*(vertices[2] - vertices[0]);
+      hit.normal = normals[0] + u*(normals[1] - normals[0]) + v*(normals[2] - normals[0]);
+      hit.triangleNormal = glm::normalize(placed.normalMatrix * local.triangleNormal);
+      hit.vertex = vertices[0];
+      hit.colour = glm::vec3(local.colour.red, local.colour.green, local.colour.blue);
+      return hit;
+    }
+
+    static ModelTriangle transformTriangle(const ModelTriangle& triangle, const glm::mat4& transform, const glm::mat3& normalMatrix)
+    {
+      ModelTriangle moved = triangle;
+      for(int k = 0; k < 3; k++) {
+        moved.vertices[k] = glm::vec3(transform * glm::vec4(triangle.vertices[k], 1));
+        moved.normals[k] = glm::normalize(normalMatrix * triangle.normals[k]);
+      }
+      moved.triangleNormal = glm::normalize(normalMatrix * triangle.triangleNormal);
+      return moved;
+    }
+
+    // Every triangle of the given instances in world space
+    std::vector<ModelTriangle> flatten(int firstInstance, int instanceCount) const
+    {
+      std::vector<ModelTriangle> world;
+      for(int i = firstInstance; i < firstInstance + instanceCount; i++) {
+        const Mesh& mesh = meshes[instances[i].mesh];
+        for(int t = mesh.first; t < mesh.first + mesh.count; t++)
+          world.push_back(worldTriangle(i, t));
+      }
+      return world;
+    }
+
+  private:
+    std::vector<AABB> instanceBounds() const
+    {
+      std::vector<AABB> bounds(instances.size());
+      for(int i = 0; i < (int) instances.size(); i++)
+        bounds[i] = instances[i].bounds;
+      return bounds;
+    }
+
+    bool buildMesh(int meshIndex, bool rebuild)
+    {
+      Mesh& mesh = meshes[meshIndex];
+      version++;
+      std::vector<AABB> bounds(mesh.count);
+      mesh.bounds = AABB();
+      for(int i = 0; i < mesh.count; i++) {
+        for(int k = 0; k < 3; k++)
+          bounds[i].grow(triangles[mesh.first + i].vertices[k]);
+        mesh.bounds.grow(bounds[i]);
+      }
+      if(!rebuild) {
+        mesh.bvh.refit(bounds);
+        rebuild = mesh.bvh.degraded();
+      }
+      if(rebuild)
+        mesh.bvh.build(bounds);
+      mesh.wideBvh.build(mesh.bvh);
+      //The store copies the vertices, so it is refilled either way
+      std::vector<int> order(mesh.count);
+      for(int i = 0; i < mesh.count; i++)
+        order[i] = mesh.first + mesh.bvh.primitiveIndices[i];
+      mesh.store.build(triangles, order, materials);
+      return rebuild;
+    }
+};
@@ -0,0 +1,84 @@
+#pragma once
+#include <glm/glm.hpp>
+#include <vector>
+#include <random>
+#include <cmath>
+#include <algorithm>
+
+#define LIGHT_SAMPLE_SETS 64
+#define LIGHT_NOISE_TILE 64
+
+// Light sample patterns precomputed from a seed. Every pixel takes one of
+// the stratified sets and shifts it by its own offset from a tiled
+// low-discrepancy dither (a Cranley-Patterson rotation), so neighbouring
+// pixels see different, evenly spread samples instead of one shared jitter.
+class LightSampler
+{
+  public:
+    LightSampler()
+    {
+      sampleCount = 0;
+    }
+
+    void build(int samples, unsigned int seed)
+    {
+      sampleCount = samples;
+      std::mt19937 random(seed);
+      std::uniform_real_distribution<float> jitter(0, 1);
+
+      //Jittered grid when the count is a square, otherwise a latin hypercube
+      sets.resize(LIGHT_SAMPLE_SETS * samples);
+      int side = (int) std::round(std::sqrt((float) samples));
+      std::vector<int> strata(samples);
+      for(int set = 0; set < LIGHT_SAMPLE_SETS; set++) {
+        glm::vec2* points = &sets[set * samples];
+        if(side * side == samples) {
+          for(int i = 0; i < samples; i++)
+            points[i] = glm::vec2((i % side + jitter(random)) / side, (i / side + jitter(random)) / side);
+        }
+        else {
+          for(int i = 0; i < samples; i++)
+            strata[i] = i;
+          std::shuffle(strata.begin(), strata.end(), random);
+          for(int i = 0; i < samples; i++)
+            points[i] = glm::vec2((i + jitter(random)) / samples, (strata[i] + jitter(random)) / samples);
+        }
+      }
+
+      //Per pixel set and offset: R2 and interleaved gradient dithers spread like blue noise
+      setIndices.resize(LIGHT_NOISE_TILE * LIGHT_NOISE_TILE);
+      offsets.resize(LIGHT_NOISE_TILE * LIGHT_NOISE_TILE);
+      for(int y = 0; y < LIGHT_NOISE_TILE; y++)
+        for(int x = 0; x < LIGHT_NOISE_TILE; x++) {
+          int cell = y * LIGHT_NOISE_TILE + x;
+          setIndices[cell] = random() % LIGHT_SAMPLE_SETS;
+          float r2 = x * 0.7548776662f + y * 0.5698402909f;
+          float gradient = 52.9829189f * glm::fract(0.06711056f * x + 0.00583715f * y);
+          offsets[cell] = glm::vec2(glm::fract(r2), glm::fract(gradient));
+        }
+    }
+
+    int size() const
+    {
+      return sampleCount;
+    }
+
+    // Sample index of pixel (x, y) as a point in [0, 1)^2, also shifted by frameOffset
+    glm::vec2 sample(int x, int y, int index, const glm::vec2& frameOffset) const
+    {
+      int cell = (y % LIGHT_NOISE_TILE) * LIGHT_NOISE_TILE + x % LIGHT_NOISE_TILE;
+      return glm::fract(sets[setIndices[cell] * sampleCount + index] + offsets[cell] + frameOffset);
+    }
+
+    // n-th point of the R2 sequence, used to move every pixel's samples between passes
+    static glm::vec2 sequence(int n)
+    {
+      return glm::fract(glm::vec2(0.5f) + (float) n * glm::vec2(0.7548776662f, 0.5698402909f));
+    }
+
+  private:
+    int sampleCount;
+    std::vector<glm::vec2> sets;
+    std::vector<int> setIndices;
+    std::vector<glm::vec2> offsets;
+};
@@ -0,0 +1,77 @@
+#pragma once
+#include <glm/glm.hpp>
+#include <vector>
+#include <algorithm>
+#include "CacheKey.h"
+
+#define LIGHTMAP_SIZE 16
+
+// Light baked over the triangles of a mesh list, a square grid of texels per
+// triangle. Texel (a, b) holds the light at u = (a + 0.5) / size and
+// v = (b + 0.5) / size on the triangle, moved onto its long edge when
+// u + v > 1, so every texel a bilinear lookup reads is filled.
+class Lightmap
+{
+  public:
+    std::vector<glm::vec3> texels;
+
+    Lightmap()
+    {
+      triangleCount = 0;
+    }
+
+    void resize(int triangles)
+    {
+      triangleCount = triangles;
+      texels.assign(triangles * LIGHTMAP_SIZE * LIGHTMAP_SIZE, glm::vec3(0, 0, 0));
+      key.invalidate();
+    }
+
+    int triangles() const
+    {
+      return triangleCount;
+    }
+
+    glm::vec3& texel(int triangle, int a, int b)
+    {
+      return texels[(triangle * LIGHTMAP_SIZE + a) * LIGHTMAP_SIZE + b];
+    }
+
+    // Barycentric point a texel is baked at
+    static glm::vec2 texelPoint(int a, int b)
+    {
+      glm::vec2 point((a + 0.5f) / LIGHTMAP_SIZE, (b + 0.5f) / LIGHTMAP_SIZE);
+      if(point.x + point.y > 1)
+        point /= point.x + point.y;
+      return point;
+    }
+
+    // Bilinear lookup at barycentric (u, v) of a triangle
+    glm::vec3 sample(int triangle, float u, float v) const
+    {
+      float x = std::min(std::max(u * LIGHTMAP_SIZE - 0.5f, 0.f), LIGHTMAP_SIZE - 1.f);
+      float y = std::min(std::max(v * LIGHTMAP_SIZE - 0.5f, 0.f), LIGHTMAP_SIZE - 1.f);
+      int a = std::min((int) x, LIGHTMAP_SIZE - 2);
+      int b = std::min((int) y, LIGHTMAP_SIZE - 2);
+      float s = x - a;
+      float t = y - b;
+      const glm::vec3* row = &texels[(triangle * LIGHTMAP_SIZE + a) * LIGHTMAP_SIZE + b];
+      const glm::vec3* next = row + LIGHTMAP_SIZE;
+      return (row[0] * (1 - t) + row[1] * t) * (1 - s) + (next[0] * (1 - t) + next[1] * t) * s;
+    }
+
+    // Every texel was baked for this light in the given version of the scene
+    void fill(const glm::vec3& lightPos, float directPower, float indirectPower, int sceneVersion)
+    {
+      key.fill(std::make_tuple(lightPos, directPower, indirectPower, sceneVersion));
+    }
+
+    bool matches(const glm::vec3& lightPos, float directPower, float indirectPower, int sceneVersion) const
+    {
+      return key.matches(std::make_tuple(lightPos, directPower, indirectPower, sceneVersion));
+    }
+
+  private:
+    int triangleCount;
+    CacheKey<std::tuple<glm::vec3, float, float, int>> key;
+};
@@ -0,0 +1,157 @@
+#pragma once
+#include <glm/glm.hpp>
+#include <vector>
+#include <map>
+#include <string>
+#include <fstream>
+#include <sstream>
+#include <iostream>
+#include <cstdint>
+
+// Triangles keep their material id in a byte
+#define MAX_MATERIALS 256
+
+// How a surface treats the rays that hit it, picked once when the table is loaded
+enum SurfaceType { DIFFUSE, GLOSSY, MIRROR, GLASS };
+
+// One material of a .mtl file
+class Material
+{
+  public:
+    std::string name;
+    glm::vec3 diffuse;
+    glm::vec3 specular;
+    glm::vec3 emission;
+    float shininess;
+    float refractiveIndex;
+    float opacity;
+    int illumination;
+    SurfaceType surface;
+
+    Material()
+    {
+      diffuse = glm::vec3(1, 1, 1);
+      specular = glm::vec3(0, 0, 0);
+      emission = glm::vec3(0, 0, 0);
+      shininess = 0;
+      refractiveIndex = 1;
+      opacity = 1;
+      illumination = 1;
+      surface = DIFFUSE;
+    }
+
+    bool emissive() const
+    {
+      return emission.x > 0 || emission.y > 0 || emission.z > 0;
+    }
+};
+
+// Every material of the scene, looked up by the small id each triangle keeps.
+// Id 0 is a white diffuse default for meshes without materials, and for
+// materials that did not fit in the table.
+class MaterialTable
+{
+  public:
+    MaterialTable()
+    {
+      Material fallback;
+      fallback.name = "Default";
+      add(fallback);
+    }
+
+    // Read the Kd, Ks, Ke, Ns, Ni, d and illum lines of a .mtl file, in any order
+    void load(const std::string& fileName)
+    {
+      std::ifstream file(fileName);
+      //CASE: File missing, only the default material is known
+      if(!file.is_open()) {
+        std::cout<<"Could not open material file "<<fileName<<", using the default material"<<std::endl;
+        return;
+      }
+      std::string line;
+      Material* current = NULL;
+      std::vector<Material> loaded;
+      while(std::getline(file, line)) {
+        std::istringstream values(line);
+        std::string key;
+        values >> key;
+        if(key == "newmtl") {
+          loaded.push_back(Material());
+          values >> loaded.back().name;
+          current = &loaded.back();
+        }
+        else if(current == NULL)
+          continue;
+        else if(key == "Kd")
+          values >> current->diffuse.x >> current->diffuse.y >> current->diffuse.z;
+        else if(key == "Ks")
+          values >> current->specular.x >> current->specular.y >> current->specular.z;
+        else if(key == "Ke")
+          values >> current->emission.x >> current->emission.y >> current->emission.z;
+        else if(key == "Ns")
+          values >> current->shininess;
+        else if(key == "Ni")
+          values >> current->refractiveIndex;
+        else if(key == "d")
+          values >> current->opacity;
+        else if(key == "illum")
+          values >> current->illumination;
+      }
+      int rejected = 0;
+      for(int i = 0; i < (int) loaded.size(); i++)
+        if(add(loaded[i]) < 0)
+          rejected++;
+      if(rejected > 0)
+        std::cout<<rejected<<" materials of "<<fileName<<" past the first "<<MAX_MATERIALS<<" use the default material"<<std::endl;
+    }
+
+    // Id of the material, replacing one of the same name, or -1 when the table is full
+    int add(Material material)
+    {
+      material.surface = surfaceType(material);
+      if(ids.count(material.name)) {
+        materials[ids[material.name]] = material;
+        return ids[material.name];
+      }
+      //CASE: Table full, a new id would not fit in a byte
+      if((int) materials.size() >= MAX_MATERIALS)
+        return -1;
+      ids[material.name] = materials.size();
+      materials.push_back(material);
+      return materials.size() - 1;
+    }
+
+    // Id of a material by name, the default for names the table does not know
+    uint8_t find(const std::string& name) const
+    {
+      std::map<std::string, uint8_t>::const_iterator it = ids.find(name);
+      return it == ids.end() ? 0 : it->second;
+    }
+
+    const Material& operator[](int id) const
+    {
+      return materials[id];
+    }
+
+    int size() const
+    {
+      return materials.size();
+    }
+
+  private:
+    std::vector<Material> materials;
+    std::map<std::string, uint8_t> ids;
+
+    // Surface type from the illumination model: 3 reflects, 4, 6 and 7 refract
+    // (as does anything see-through), 2 with a specular colour is glossy
+    static SurfaceType surfaceType(const Material& material)
+    {
+      if(material.illumination == 4 || material.illumination == 6 || material.illumination == 7 || material.opacity < 1)
+        return GLASS;
+      if(material.illumination == 3)
+        return MIRROR;
+      if(material.illumination == 2 && (material.specular.x > 0 || material.specular.y > 0 || material.specular.z > 0))
+        return GLOSSY;
+      return DIFFUSE;
+    }
+};
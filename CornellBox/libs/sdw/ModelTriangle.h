@@ -1,6 +1,8 @@
+#pragma once
 #include <glm/glm.hpp>
 #include "Colour.h"
 #include <string>
+#include <cstdint>
 #include "TexturePoint.h"
 
 class ModelTriangle
@@ -11,9 +13,11 @@ class ModelTriangle
     glm::vec3 normals[3];
     glm::vec3 triangleNormal;
     TexturePoint texturePoint[3];
+    uint8_t material;
 
     ModelTriangle()
     {
+      material = 0;
     }
 
     ModelTriangle(glm::vec3 v0, glm::vec3 v1, glm::vec3 v2, Colour trigColour)
@@ -22,6 +26,7 @@ class ModelTriangle
       vertices[1] = v1;
       vertices[2] = v2;
       colour = trigColour;
+      material = 0;
       texturePoint[0] = TexturePoint(-1,-1);;
       texturePoint[1] = TexturePoint(-1,-1);;
       texturePoint[2] = TexturePoint(-1,-1);;
@@ -0,0 +1,37 @@
+#pragma once
+#include <cstdint>
+
+// PCG32 generator, small and cheap enough to make a fresh one for every pixel
+// of every pass. Seeding with the pixel and the pass number makes each pass
+// repeatable while every pixel and pass draws its own stream.
+class Random
+{
+  public:
+    Random(uint64_t seed, uint64_t stream)
+    {
+      state = 0;
+      increment = (stream << 1) | 1;
+      next();
+      state += seed;
+      next();
+    }
+
+    uint32_t next()
+    {
+      uint64_t old = state;
+      state = old * 6364136223846793005ULL + increment;
+      uint32_t shifted = (uint32_t) (((old >> 18) ^ old) >> 27);
+      uint32_t rotation = (uint32_t) (old >> 59);
+      return (shifted >> rotation) | (shifted << ((-rotation) & 31));
+    }
+
+    // Uniform float in [0, 1)
+    float uniform()
+    {
+      return (next() >> 8) * (1.0f / 16777216.0f);
+    }
+
+  private:
+    uint64_t state;
+    uint64_t increment;
+};
@@ -0,0 +1,146 @@
+#pragma once
+#include <glm/glm.hpp>
+#include <cstdint>
+#include <cmath>
+#include <algorithm>
+#include "Colour.h"
+#include "CanvasTriangle.h"
+
+#define FIXED_POINT_BITS 8
+#define FIXED_POINT_ONE (1 << FIXED_POINT_BITS)
+#define RASTER_ATTRIBUTES 7
+
+// What the pixels of a rasterised triangle are coloured with: its colour or
+// the texture, lit by the interpolated brightness or by its lightmap
+class RasterShading
+{
+  public:
+    Colour colour;
+    bool texture;
+    // Lightmap triangle, -1 for the interpolated brightness
+    int bakedTriangle;
+    // World space normal on the side facing the camera
+    glm::vec3 normal;
+
+    RasterShading()
+    {
+      texture = false;
+      bakedTriangle = -1;
+    }
+
+    RasterShading(Colour c, bool textured, int baked, glm::vec3 n)
+    {
+      colour = c;
+      texture = textured;
+      bakedTriangle = baked;
+      normal = n;
+    }
+};
+
+// A canvas triangle set up for half-space rasterisation: vertices snapped to
+// fixed point, the three edge functions with their per pixel steps and
+// top-left biases, and the attributes to interpolate from the barycentrics.
+// Pixel (x, y) is sampled at the point (x, y). Edge k is opposite vertex k.
+class RasterTriangle
+{
+  public:
+    // Pixels the triangle can cover, clipped to the screen
+    int minX, minY, maxX, maxY;
+    // Edge values at (minX, minY), their steps per pixel and the bias that
+    // keeps pixels exactly on an edge that is not top or left outside
+    int64_t edgeStart[3];
+    int64_t edgeStepX[3];
+    int64_t edgeStepY[3];
+    int64_t edgeBias[3];
+    // Depth, brightness, texture point, 1/z and lightmap point at vertex 0,
+    // and their change towards vertices 1 and 2
+    float attributes[RASTER_ATTRIBUTES];
+    float toVertex1[RASTER_ATTRIBUTES];
+    float toVertex2[RASTER_ATTRIBUTES];
+    float inverseArea;
+    RasterShading shading;
+
+    RasterTriangle()
+    {
+      minX = minY = 0;
+      maxX = maxY = -1;
+    }
+
+    RasterTriangle(CanvasTriangle triangle, const RasterShading& triangleShading, int width, int height)
+    {
+      shading = triangleShading;
+      minX = minY = 0;
+      maxX = maxY = -1;
+      int64_t fixedX[3], fixedY[3];
+      for(int i = 0; i < 3; i++) {
+        fixedX[i] = llround(triangle.vertices[i].x * FIXED_POINT_ONE);
+        fixedY[i] = llround(triangle.vertices[i].y * FIXED_POINT_ONE);
+      }
+      int64_t area = (fixedX[1] - fixedX[0]) * (fixedY[2] - fixedY[0]) - (fixedY[1] - fixedY[0]) * (fixedX[2] - fixedX[0]);
+      //CASE: Triangle has no area on screen
+      if(area == 0)
+        return;
+      //Wind the triangle so the inside of every edge is positive
+      if(area < 0) {
+        std::swap(triangle.vertices[1], triangle.vertices[2]);
+        std::swap(fixedX[1], fixedX[2]);
+        std::swap(fixedY[1], fixedY[2]);
+        area = -area;
+      }
+      minX = std::max(0, (int) ((std::min(fixedX[0], std::min(fixedX[1], fixedX[2])) + FIXED_POINT_ONE - 1) >> FIXED_POINT_BITS));
+      minY = std::max(0, (int) ((std::min(fixedY[0], std::min(fixedY[1], fixedY[2])) + FIXED_POINT_ONE - 1) >> FIXED_POINT_BITS));
+      maxX = std::min(width - 1, (int) (std::max(fixedX[0], std::max(fixedX[1], fixedX[2])) >> FIXED_POINT_BITS));
+      maxY = std::min(height - 1, (int) (std::max(fixedY[0], std::max(fixedY[1], fixedY[2])) >> FIXED_POINT_BITS));
+
+      for(int k = 0; k < 3; k++) {
+        int a = (k + 1) % 3, b = (k + 2) % 3;
+        int64_t dx = fixedX[b] - fixedX[a];
+        int64_t dy = fixedY[b] - fixedY[a];
+        edgeStart[k] = dx * (((int64_t) minY << FIXED_POINT_BITS) - fixedY[a]) - dy * (((int64_t) minX << FIXED_POINT_BITS) - fixedX[a]);
+        edgeStepX[k] = -dy * FIXED_POINT_ONE;
+        edgeStepY[k] = dx * FIXED_POINT_ONE;
+        edgeBias[k] = (dy < 0 || (dy == 0 && dx > 0)) ? 0 : -1;
+      }
+
+      float values[3][RASTER_ATTRIBUTES];
+      for(int i = 0; i < 3; i++) {
+        const CanvasPoint& v = triangle.vertices[i];
+        values[i][0] = v.depth;
+        values[i][1] = v.brightness;
+        values[i][2] = v.texturePoint.x;
+        values[i][3] = v.texturePoint.y;
+        values[i][4] = v.pos3d.z;
+        values[i][5] = v.lightmapPoint.x;
+        values[i][6] = v.lightmapPoint.y;
+      }
+      for(int a = 0; a < RASTER_ATTRIBUTES; a++) {
+        attributes[a] = values[0][a];
+        toVertex1[a] = values[1][a] - values[0][a];
+        toVertex2[a] = values[2][a] - values[0][a];
+      }
+      inverseArea = 1.0f / area;
+    }
+
+    bool empty() const
+    {
+      return minX > maxX || minY > maxY;
+    }
+
+    // Value of edge k at pixel (x, y), exact anywhere on the screen
+    int64_t edge(int k, int x, int y) const
+    {
+      return edgeStart[k] + (int64_t) (x - minX) * edgeStepX[k] + (int64_t) (y - minY) * edgeStepY[k];
+    }
+
+    // Whether some pixel of the rectangle [x0, x1] x [y0, y1] can be inside,
+    // every edge is linear so its largest value is at a corner
+    bool overlaps(int x0, int y0, int x1, int y1) const
+    {
+      for(int k = 0; k < 3; k++) {
+        int64_t best = std::max(std::max(edge(k, x0, y0), edge(k, x1, y0)), std::max(edge(k, x0, y1), edge(k, x1, y1)));
+        if(best + edgeBias[k] < 0)
+          return false;
+      }
+      return true;
+    }
+};
@@ -0,0 +1,198 @@
+#pragma once
+#include <glm/glm.hpp>
+#include <limits>
+#include "BVH.h"
+
+// Thin wrapper over the widest float vector the compiler targets:
+// AVX2 packs 8 rays, SSE2 packs 4, anything else falls back to scalar loops.
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define PACKET_SIZE 8
+typedef __m256 PacketFloat;
+inline PacketFloat packetSet(float a) { return _mm256_set1_ps(a); }
+inline PacketFloat packetLoad(const float* p) { return _mm256_loadu_ps(p); }
+inline void packetStore(float* p, PacketFloat a) { _mm256_storeu_ps(p, a); }
+inline PacketFloat packetAdd(PacketFloat a, PacketFloat b) { return _mm256_add_ps(a, b); }
+inline PacketFloat packetSub(PacketFloat a, PacketFloat b) { return _mm256_sub_ps(a, b); }
+inline PacketFloat packetMul(PacketFloat a, PacketFloat b) { return _mm256_mul_ps(a, b); }
+inline PacketFloat packetDiv(PacketFloat a, PacketFloat b) { return _mm256_div_ps(a, b); }
+inline PacketFloat packetMin(PacketFloat a, PacketFloat b) { return _mm256_min_ps(a, b); }
+inline PacketFloat packetMax(PacketFloat a, PacketFloat b) { return _mm256_max_ps(a, b); }
+inline PacketFloat packetGreaterEqual(PacketFloat a, PacketFloat b) { return _mm256_cmp_ps(a, b, _CMP_GE_OQ); }
+inline PacketFloat packetLess(PacketFloat a, PacketFloat b) { return _mm256_cmp_ps(a, b, _CMP_LT_OQ); }
+inline PacketFloat packetAnd(PacketFloat a, PacketFloat b) { return _mm256_and_ps(a, b); }
+inline PacketFloat packetAbs(PacketFloat a) { return _mm256_andnot_ps(_mm256_set1_ps(-0.0f), a); }
+inline PacketFloat packetSelect(PacketFloat mask, PacketFloat a, PacketFloat b) { return _mm256_blendv_ps(b, a, mask); }
+inline int packetMask(PacketFloat mask) { return _mm256_movemask_ps(mask); }
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#define PACKET_SIZE 4
+typedef __m128 PacketFloat;
+inline PacketFloat packetSet(float a) { return _mm_set1_ps(a); }
+inline PacketFloat packetLoad(const float* p) { return _mm_loadu_ps(p); }
+inline void packetStore(float* p, PacketFloat a) { _mm_storeu_ps(p, a); }
+inline PacketFloat packetAdd(PacketFloat a, PacketFloat b) { return _mm_add_ps(a, b); }
+inline PacketFloat packetSub(PacketFloat a, PacketFloat b) { return _mm_sub_ps(a, b); }
+inline PacketFloat packetMul(PacketFloat a, PacketFloat b) { return _mm_mul_ps(a, b); }
+inline PacketFloat packetDiv(PacketFloat a, PacketFloat b) { return _mm_div_ps(a, b); }
+inline PacketFloat packetMin(PacketFloat a, PacketFloat b) { return _mm_min_ps(a, b); }
+inline PacketFloat packetMax(PacketFloat a, PacketFloat b) { return _mm_max_ps(a, b); }
+inline PacketFloat packetGreaterEqual(PacketFloat a, PacketFloat b) { return _mm_cmpge_ps(a, b); }
+inline PacketFloat packetLess(PacketFloat a, PacketFloat b) { return _mm_cmplt_ps(a, b); }
+inline PacketFloat packetAnd(PacketFloat a, PacketFloat b) { return _mm_and_ps(a, b); }
+inline PacketFloat packetAbs(PacketFloat a) { return _mm_andnot_ps(_mm_set1_ps(-0.0f), a); }
+inline PacketFloat packetSelect(PacketFloat mask, PacketFloat a, PacketFloat b) { return _mm_or_ps(_mm_and_ps(mask, a), _mm_andnot_ps(mask, b)); }
+inline int packetMask(PacketFloat mask) { return _mm_movemask_ps(mask); }
+#else
+#include <cstring>
+#define PACKET_SIZE 4
+class PacketFloat
+{
+  public:
+    float v[PACKET_SIZE];
+};
+inline PacketFloat packetSet(float a) { PacketFloat r; for(int i = 0; i < PACKET_SIZE; i++) r.v[i] = a; return r; }
+inline PacketFloat packetLoad(const float* p) { PacketFloat r; for(int i = 0; i < PACKET_SIZE; i++) r.v[i] = p[i]; return r; }
+inline void packetStore(float* p, PacketFloat a) { for(int i = 0; i < PACKET_SIZE; i++) p[i] = a.v[i]; }
+inline PacketFloat packetAdd(PacketFloat a, PacketFloat b) { for(int i = 0; i < PACKET_SIZE; i++) a.v[i] += b.v[i]; return a; }
+inline PacketFloat packetSub(PacketFloat a, PacketFloat b) { for(int i = 0; i < PACKET_SIZE; i++) a.v[i] -= b.v[i]; return a; }
+inline PacketFloat packetMul(PacketFloat a, PacketFloat b) { for(int i = 0; i < PACKET_SIZE; i++) a.v[i] *= b.v[i]; return a; }
+inline PacketFloat packetDiv(PacketFloat a, PacketFloat b) { for(int i = 0; i < PACKET_SIZE; i++) a.v[i] /= b.v[i]; return a; }
+inline PacketFloat packetMin(PacketFloat a, PacketFloat b) { for(int i = 0; i < PACKET_SIZE; i++) a.v[i] = a.v[i] < b.v[i] ? a.v[i] : b.v[i]; return a; }
+inline PacketFloat packetMax(PacketFloat a, PacketFloat b) { for(int i = 0; i < PACKET_SIZE; i++) a.v[i] = a.v[i] > b.v[i] ? a.v[i] : b.v[i]; return a; }
+inline PacketFloat packetFromBools(const bool* b) { PacketFloat r; for(int i = 0; i < PACKET_SIZE; i++) { unsigned int bits = b[i] ? 0xffffffffu : 0u; std::memcpy(&r.v[i], &bits, 4); } return r; }
+inline bool packetLane(PacketFloat mask, int i) { unsigned int bits; std::memcpy(&bits, &mask.v[i], 4); return bits != 0; }
+inline PacketFloat packetGreaterEqual(PacketFloat a, PacketFloat b) { bool r[PACKET_SIZE]; for(int i = 0; i < PACKET_SIZE; i++) r[i] = a.v[i] >= b.v[i]; return packetFromBools(r); }
+inline PacketFloat packetLess(PacketFloat a, PacketFloat b) { bool r[PACKET_SIZE]; for(int i = 0; i < PACKET_SIZE; i++) r[i] = a.v[i] < b.v[i]; return packetFromBools(r); }
+inline PacketFloat packetAnd(PacketFloat a, PacketFloat b) { bool r[PACKET_SIZE]; for(int i = 0; i < PACKET_SIZE; i++) r[i] = packetLane(a, i) && packetLane(b, i); return packetFromBools(r); }
+inline PacketFloat packetAbs(PacketFloat a) { for(int i = 0; i < PACKET_SIZE; i++) a.v[i] = a.v[i] < 0 ? -a.v[i] : a.v[i]; return a; }
+inline PacketFloat packetSelect(PacketFloat mask, PacketFloat a, PacketFloat b) { for(int i = 0; i < PACKET_SIZE; i++) if(!packetLane(mask, i)) a.v[i] = b.v[i]; return a; }
+inline int packetMask(PacketFloat mask) { int m = 0; for(int i = 0; i < PACKET_SIZE; i++) if(packetLane(mask, i)) m |= 1 << i; return m; }
+#endif
+
+#define PACKET_EPSILON 1e-8f
+#define PACKET_MIN_DISTANCE 0.001f
+
+// A bundle of coherent rays stored lane by lane, together with their closest hits
+class RayPacket
+{
+  public:
+    float originX[PACKET_SIZE];
+    float originY[PACKET_SIZE];
+    float originZ[PACKET_SIZE];
+    float dirX[PACKET_SIZE];
+    float dirY[PACKET_SIZE];
+    float dirZ[PACKET_SIZE];
+    float t[PACKET_SIZE];
+    float u[PACKET_SIZE];
+    float v[PACKET_SIZE];
+    int triangleIndex[PACKET_SIZE];
+    int instanceIndex[PACKET_SIZE];
+
+    RayPacket()
+    {
+      for(int i = 0; i < PACKET_SIZE; i++) {
+        t[i] = std::numeric_limits<float>::max();
+        u[i] = 0;
+        v[i] = 0;
+        triangleIndex[i] = -1;
+        instanceIndex[i] = -1;
+      }
+    }
+
+    void setRay(int lane, const glm::vec3& origin, const glm::vec3& direction)
+    {
+      originX[lane] = origin.x;
+      originY[lane] = origin.y;
+      originZ[lane] = origin.z;
+      dirX[lane] = direction.x;
+      dirY[lane] = direction.y;
+      dirZ[lane] = direction.z;
+    }
+
+    // Copy of the packet with its rays moved by transform, the hits are kept.
+    // Directions are not renormalised so distances match the original rays.
+    RayPacket transformed(const glm::mat4& transform) const
+    {
+      RayPacket moved = *this;
+      glm::mat3 linear(transform);
+      for(int lane = 0; lane < PACKET_SIZE; lane++) {
+        glm::vec3 origin(transform * glm::vec4(originX[lane], originY[lane], originZ[lane], 1));
+        glm::vec3 direction = linear * glm::vec3(dirX[lane], dirY[lane], dirZ[lane]);
+        moved.setRay(lane, origin, direction);
+      }
+      return moved;
+    }
+};
+
+// True when at least one ray of the packet enters the box before its closest hit
+inline bool intersectPacketBox(const RayPacket& packet, const AABB& box)
+{
+  PacketFloat tEnter = packetSet(0);
+  PacketFloat tExit = packetLoad(packet.t);
+  const float* origins[3] = {packet.originX, packet.originY, packet.originZ};
+  const float* dirs[3] = {packet.dirX, packet.dirY, packet.dirZ};
+  for(int axis = 0; axis < 3; axis++) {
+    PacketFloat origin = packetLoad(origins[axis]);
+    PacketFloat invDir = packetDiv(packetSet(1.0f), packetLoad(dirs[axis]));
+    PacketFloat t0 = packetMul(packetSub(packetSet(box.min[axis]), origin), invDir);
+    PacketFloat t1 = packetMul(packetSub(packetSet(box.max[axis]), origin), invDir);
+    tEnter = packetMax(tEnter, packetMin(t0, t1));
+    tExit = packetMin(tExit, packetMax(t0, t1));
+  }
+  return packetMask(packetGreaterEqual(tExit, tEnter)) != 0;
+}
+
+// Moller-Trumbore test of every ray in the packet against one triangle.
+// Lanes that hit closer than their current hit take (t, u, v, index), where
+// the hit point is v0 + u*e0 + v*e1. Returns as soon as no lane can hit.
+inline void intersectPacketTriangle(RayPacket& packet, const glm::vec3& v0, const glm::vec3& e0, const glm::vec3& e1, int index)
+{
+  PacketFloat dx = packetLoad(packet.dirX);
+  PacketFloat dy = packetLoad(packet.dirY);
+  PacketFloat dz = packetLoad(packet.dirZ);
+  PacketFloat e0x = packetSet(e0.x), e0y = packetSet(e0.y), e0z = packetSet(e0.z);
+  PacketFloat e1x = packetSet(e1.x), e1y = packetSet(e1.y), e1z = packetSet(e1.z);
+
+  //pvec = dir x e1
+  PacketFloat px = packetSub(packetMul(dy, e1z), packetMul(dz, e1y));
+  PacketFloat py = packetSub(packetMul(dz, e1x), packetMul(dx, e1z));
+  PacketFloat pz = packetSub(packetMul(dx, e1y), packetMul(dy, e1x));
+  PacketFloat det = packetAdd(packetAdd(packetMul(e0x, px), packetMul(e0y, py)), packetMul(e0z, pz));
+  PacketFloat mask = packetGreaterEqual(packetAbs(det), packetSet(PACKET_EPSILON));
+  if(packetMask(mask) == 0)
+    return;
+  PacketFloat invDet = packetDiv(packetSet(1.0f), det);
+
+  //tvec = origin - v0
+  PacketFloat tx = packetSub(packetLoad(packet.originX), packetSet(v0.x));
+  PacketFloat ty = packetSub(packetLoad(packet.originY), packetSet(v0.y));
+  PacketFloat tz = packetSub(packetLoad(packet.originZ), packetSet(v0.z));
+  PacketFloat u = packetMul(packetAdd(packetAdd(packetMul(tx, px), packetMul(ty, py)), packetMul(tz, pz)), invDet);
+  mask = packetAnd(mask, packetAnd(packetGreaterEqual(u, packetSet(0)), packetGreaterEqual(packetSet(1), u)));
+  if(packetMask(mask) == 0)
+    return;
+
+  //qvec = tvec x e0
+  PacketFloat qx = packetSub(packetMul(ty, e0z), packetMul(tz, e0y));
+  PacketFloat qy = packetSub(packetMul(tz, e0x), packetMul(tx, e0z));
+  PacketFloat qz = packetSub(packetMul(tx, e0y), packetMul(ty, e0x));
+  PacketFloat v = packetMul(packetAdd(packetAdd(packetMul(dx, qx), packetMul(dy, qy)), packetMul(dz, qz)), invDet);
+  mask = packetAnd(mask, packetAnd(packetGreaterEqual(v, packetSet(0)), packetGreaterEqual(packetSet(1), packetAdd(u, v))));
+  if(packetMask(mask) == 0)
+    return;
+
+  PacketFloat t = packetMul(packetAdd(packetAdd(packetMul(e1x, qx), packetMul(e1y, qy)), packetMul(e1z, qz)), invDet);
+  PacketFloat tCurrent = packetLoad(packet.t);
+  mask = packetAnd(mask, packetAnd(packetGreaterEqual(t, packetSet(PACKET_MIN_DISTANCE)), packetLess(t, tCurrent)));
+  int hits = packetMask(mask);
+  if(hits == 0)
+    return;
+
+  packetStore(packet.t, packetSelect(mask, t, tCurrent));
+  packetStore(packet.u, packetSelect(mask, u, packetLoad(packet.u)));
+  packetStore(packet.v, packetSelect(mask, v, packetLoad(packet.v)));
+  for(int i = 0; i < PACKET_SIZE; i++)
+    if(hits & (1 << i))
+      packet.triangleIndex[i] = index;
+}
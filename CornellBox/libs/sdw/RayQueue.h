@@ -0,0 +1,85 @@
+#pragma once
+#include <glm/glm.hpp>
+#include <vector>
+#include <algorithm>
+#include <cstdint>
+#include "BVH.h"
+
+#define RAY_QUEUE_KEY_BITS 10
+
+// A ray waiting to be traced, with the pixel it ends up colouring.
+// depth counts the mirror and glass bounces behind it and throughput is the
+// product of their reflectances, so paths that went dim can be dropped.
+class QueuedRay
+{
+  public:
+    glm::vec3 origin;
+    glm::vec3 direction;
+    int pixel;
+    int depth;
+    int glassBounces;
+    float throughput;
+    uint64_t key;
+};
+
+// Rays gathered over a frame. Sorting puts rays that start close together
+// and point the same way next to each other, so batches taken in queue
+// order walk the same parts of the scene.
+class RayQueue
+{
+  public:
+    std::vector<QueuedRay> rays;
+
+    RayQueue()
+    {
+    }
+
+    int size() const
+    {
+      return rays.size();
+    }
+
+    bool empty() const
+    {
+      return rays.empty();
+    }
+
+    void push(const QueuedRay& ray)
+    {
+      rays.push_back(ray);
+    }
+
+    void append(const std::vector<QueuedRay>& more)
+    {
+      rays.insert(rays.end(), more.begin(), more.end());
+    }
+
+    // Sort by a 6D Morton key of the origin (inside bounds) and the direction
+    void sort(const AABB& bounds)
+    {
+      glm::vec3 extent = glm::max(bounds.max - bounds.min, glm::vec3(1e-6f));
+      for(int i = 0; i < (int) rays.size(); i++) {
+        glm::vec3 origin = glm::clamp((rays[i].origin - bounds.min) / extent, 0.0f, 1.0f);
+        glm::vec3 direction = glm::normalize(rays[i].direction) * 0.5f + 0.5f;
+        rays[i].key = mortonKey(origin, direction);
+      }
+      std::sort(rays.begin(), rays.end(), [](const QueuedRay& a, const QueuedRay& b) { return a.key < b.key; });
+    }
+
+  private:
+    // Interleave the bits of six coordinates in [0, 1], origin first
+    static uint64_t mortonKey(const glm::vec3& origin, const glm::vec3& direction)
+    {
+      const int scale = (1 << RAY_QUEUE_KEY_BITS) - 1;
+      uint32_t coords[6];
+      for(int axis = 0; axis < 3; axis++) {
+        coords[axis] = (uint32_t) (origin[axis] * scale);
+        coords[3 + axis] = (uint32_t) (direction[axis] * scale);
+      }
+      uint64_t key = 0;
+      for(int bit = RAY_QUEUE_KEY_BITS - 1; bit >= 0; bit--)
+        for(int axis = 0; axis < 6; axis++)
+          key = (key << 1) | ((coords[axis] >> bit) & 1);
+      return key;
+    }
+};
@@ -1,30 +1,45 @@
-#include <glm/glm.hpp>
-#include <iostream>
+#pragma once
+#include <limits>
+#include <type_traits>
 
+// Compact hit record: the distance along the ray, the barycentric
+// coordinates of the hit and which instance, triangle and material were hit.
+// Positions and normals are resolved into a SurfaceHit once the closest
+// hit is final. A default constructed record is a miss.
 class RayTriangleIntersection
 {
   public:
-    glm::vec3 intersectionPoint;
     float distanceFromCamera;
-    ModelTriangle intersectedTriangle;
-    glm::vec3 normal;
-    glm::vec3 triangleNormal;
+    float u;
+    float v;
+    int instanceIndex;
     int triangleIndex;
+    int materialIndex;
 
     RayTriangleIntersection()
     {
+        distanceFromCamera = std::numeric_limits<float>::max();
+        u = 0;
+        v = 0;
+        instanceIndex = -1;
+        triangleIndex = -1;
+        materialIndex = -1;
     }
 
-    RayTriangleIntersection(glm::vec3 point, float distance, ModelTriangle triangle)
+    RayTriangleIntersection(float distance, float hitU, float hitV, int instance, int triangle, int material)
     {
-        intersectionPoint = point;
         distanceFromCamera = distance;
-        intersectedTriangle = triangle;
+        u = hitU;
+        v = hitV;
+        instanceIndex = instance;
+        triangleIndex = triangle;
+        materialIndex = material;
+    }
+
+    bool found() const
+    {
+        return triangleIndex >= 0;
     }
 };
 
-// std::ostream& operator<<(std::ostream& os, const RayTriangleIntersection& intersection)
-// {
-//     os << "Intersection is at " << intersection.intersectionPoint << " on triangle " << intersection.intersectedTriangle << " at a distance of " << intersection.distanceFromCamera << std::endl;
-//     return os;
-// }
+static_assert(std::is_trivially_copyable<RayTriangleIntersection>::value, "hit records are copied as raw bytes");
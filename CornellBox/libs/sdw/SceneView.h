@@ -0,0 +1,54 @@
+#pragma once
+#include <vector>
+#include "ModelTriangle.h"
+#include "InstancedScene.h"
+
+// Read-only view of a world space triangle list, which the rasteriser
+// draws, and of the two level structure the ray tracer intersects.
+// Rays only see the first instanceCount instances of the structure.
+// It never owns or copies the triangles, so it is cheap to pass around;
+// the vector it was made from must outlive it and must not be resized.
+class SceneView
+{
+  public:
+    const ModelTriangle* triangles;
+    int count;
+    const InstancedScene* instances;
+    int instanceCount;
+
+    SceneView()
+    {
+      triangles = NULL;
+      count = 0;
+      instances = NULL;
+      instanceCount = 0;
+    }
+
+    SceneView(const std::vector<ModelTriangle>& list, const InstancedScene* instanced)
+    {
+      triangles = list.empty() ? NULL : &list[0];
+      count = list.size();
+      instances = instanced;
+      instanceCount = instanced == NULL ? 0 : instanced->instances.size();
+    }
+
+    int size() const
+    {
+      return count;
+    }
+
+    const ModelTriangle& operator[](int index) const
+    {
+      return triangles[index];
+    }
+
+    const ModelTriangle* begin() const
+    {
+      return triangles;
+    }
+
+    const ModelTriangle* end() const
+    {
+      return triangles + count;
+    }
+};
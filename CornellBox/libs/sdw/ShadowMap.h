@@ -0,0 +1,109 @@
+#pragma once
+#include <glm/glm.hpp>
+#include <vector>
+#include <cmath>
+#include <algorithm>
+#include "VisibilityBuffer.h"
+#include "CacheKey.h"
+
+#define SHADOW_MAP_SIZE 512
+#define SHADOW_BIAS 0.01f
+#define SHADOW_NORMAL_OFFSET 2.0f
+
+// Depth of the scene seen from a point light, as a cube of six 90 degree
+// faces rasterised with the visibility buffer. A point is in shadow when the
+// face looking its way saw something nearer the light than it is.
+class ShadowMap
+{
+  public:
+    ShadowMap(int faceSize)
+    {
+      size = faceSize;
+      glm::vec3 directions[6] = {glm::vec3(1, 0, 0), glm::vec3(-1, 0, 0), glm::vec3(0, 1, 0), glm::vec3(0, -1, 0), glm::vec3(0, 0, 1), glm::vec3(0, 0, -1)};
+      glm::vec3 ups[6] = {glm::vec3(0, 1, 0), glm::vec3(0, 1, 0), glm::vec3(0, 0, 1), glm::vec3(0, 0, 1), glm::vec3(0, 1, 0), glm::vec3(0, 1, 0)};
+      for(int face = 0; face < 6; face++) {
+        //Columns are the face camera's right, up and backward, it looks down -z
+        glm::vec3 backward = -directions[face];
+        glm::vec3 right = glm::cross(ups[face], backward);
+        orientations[face] = glm::mat3(right, ups[face], backward);
+        faces.push_back(VisibilityBuffer(size, size, size / 2));
+      }
+    }
+
+    void clear(const glm::vec3& lightPos)
+    {
+      light = lightPos;
+      for(int face = 0; face < 6; face++)
+        faces[face].clear();
+      key.invalidate();
+    }
+
+    // Rasterise a world space triangle into every face it can reach
+    void drawTriangle(const glm::vec3* vertices)
+    {
+      for(int face = 0; face < 6; face++) {
+        glm::vec3 projected[3];
+        for(int k = 0; k < 3; k++)
+          projected[k] = (vertices[k] - light) * orientations[face];
+        faces[face].drawTriangle(projected, 0, 0);
+      }
+    }
+
+    // Every face was drawn for the light in the given version of the scene
+    void fill(int sceneVersion)
+    {
+      key.fill(std::make_tuple(light, sceneVersion));
+    }
+
+    bool matches(const glm::vec3& lightPos, int sceneVersion) const
+    {
+      return key.matches(std::make_tuple(lightPos, sceneVersion));
+    }
+
+    // Fraction of the light reaching a world space point, 0 or 1 from the
+    // nearest texel, or averaged over the 3x3 around it when filtered. The
+    // point is first moved off its surface along the normal by a couple of
+    // texels, so surfaces at grazing angles to the light do not shadow themselves.
+    float visibility(const glm::vec3& point, const glm::vec3& normal, bool filtered) const
+    {
+      float texel = 2 * glm::length(point - light) / size;
+      glm::vec3 direction = point + normal * (SHADOW_NORMAL_OFFSET * texel) - light;
+      glm::vec3 magnitude = glm::abs(direction);
+      int face;
+      if(magnitude.x >= magnitude.y && magnitude.x >= magnitude.z)
+        face = direction.x > 0 ? 0 : 1;
+      else if(magnitude.y >= magnitude.z)
+        face = direction.y > 0 ? 2 : 3;
+      else
+        face = direction.z > 0 ? 4 : 5;
+      glm::vec3 local = direction * orientations[face];
+      float depth = -local.z;
+      //CASE: Point at the light itself
+      if(depth <= VISIBILITY_NEAR_PLANE)
+        return 1;
+      int x = clampTexel((int) std::round(local.x * (size / 2) / local.z + size / 2));
+      int y = clampTexel((int) std::round(local.y * (size / 2) / local.z + size / 2));
+      const VisibilityBuffer& buffer = faces[face];
+      int radius = filtered ? 1 : 0;
+      int lit = 0, taps = 0;
+      for(int i = x - radius; i <= x + radius; i++)
+        for(int j = y - radius; j <= y + radius; j++) {
+          taps++;
+          if(depth <= buffer.depth[clampTexel(i) * size + clampTexel(j)] + SHADOW_BIAS * depth)
+            lit++;
+        }
+      return lit / (float) taps;
+    }
+
+  private:
+    int size;
+    glm::mat3 orientations[6];
+    std::vector<VisibilityBuffer> faces;
+    glm::vec3 light;
+    CacheKey<std::tuple<glm::vec3, int>> key;
+
+    int clampTexel(int texel) const
+    {
+      return std::min(std::max(texel, 0), size - 1);
+    }
+};
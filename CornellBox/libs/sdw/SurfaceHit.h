@@ -0,0 +1,21 @@
+#pragma once
+#include <glm/glm.hpp>
+#include <type_traits>
+
+// World space surface at a hit, resolved from the hit record once the closest
+// hit is final so shading never copies or transforms the triangle again.
+// A value initialised record stands for a miss.
+class SurfaceHit
+{
+  public:
+    glm::vec3 point;
+    // Interpolated vertex normal, not renormalised
+    glm::vec3 normal;
+    glm::vec3 triangleNormal;
+    // First vertex, the camera's facing tests are made against it
+    glm::vec3 vertex;
+    // Colour of the triangle, 0 to 255 per channel
+    glm::vec3 colour;
+};
+
+static_assert(std::is_trivially_copyable<SurfaceHit>::value, "surface hits are plain values");
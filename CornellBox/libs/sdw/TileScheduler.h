@@ -0,0 +1,152 @@
+#pragma once
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+
+// Pool of worker threads that run numbered tasks (e.g. screen tiles).
+// Every worker owns a queue seeded with a contiguous block of tasks and
+// steals from the back of the other queues once its own runs dry.
+// The calling thread takes part as worker 0.
+class TileScheduler
+{
+  private:
+    class WorkQueue
+    {
+      public:
+        std::mutex lock;
+        std::deque<int> tasks;
+    };
+
+    std::vector<std::thread> workers;
+    std::vector<WorkQueue*> queues;
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::condition_variable finished;
+    const std::function<void(int)>* job;
+    int generation;
+    int pending;
+    bool stop;
+
+  public:
+    TileScheduler(int threads)
+    {
+      if(threads < 1)
+        threads = 1;
+      job = NULL;
+      generation = 0;
+      pending = 0;
+      stop = false;
+      for(int i = 0; i < threads; i++)
+        queues.push_back(new WorkQueue());
+      for(int i = 1; i < threads; i++)
+        workers.push_back(std::thread(&TileScheduler::workerLoop, this, i));
+    }
+
+    ~TileScheduler()
+    {
+      {
+        std::unique_lock<std::mutex> guard(mutex);
+        stop = true;
+      }
+      wake.notify_all();
+      for(int i = 0; i < (int) workers.size(); i++)
+        workers[i].join();
+      for(int i = 0; i < (int) queues.size(); i++)
+        delete queues[i];
+    }
+
+    int threadCount() const
+    {
+      return queues.size();
+    }
+
+    // Run task(0) ... task(numTasks - 1) and return once all of them are done
+    void run(int numTasks, const std::function<void(int)>& task)
+    {
+      if(numTasks <= 0)
+        return;
+      int threads = queues.size();
+      for(int i = 0; i < threads; i++) {
+        std::unique_lock<std::mutex> guard(queues[i]->lock);
+        queues[i]->tasks.clear();
+        for(int t = numTasks * i / threads; t < numTasks * (i + 1) / threads; t++)
+          queues[i]->tasks.push_back(t);
+      }
+      if(workers.empty()) {
+        work(0, task);
+        return;
+      }
+
+      {
+        std::unique_lock<std::mutex> guard(mutex);
+        job = &task;
+        pending = workers.size();
+        generation++;
+      }
+      wake.notify_all();
+      work(0, task);
+
+      std::unique_lock<std::mutex> guard(mutex);
+      finished.wait(guard, [this] { return pending == 0; });
+      job = NULL;
+    }
+
+  private:
+    void workerLoop(int id)
+    {
+      int seen = 0;
+      while(true) {
+        const std::function<void(int)>* current;
+        {
+          std::unique_lock<std::mutex> guard(mutex);
+          wake.wait(guard, [this, &seen] { return stop || generation != seen; });
+          if(stop)
+            return;
+          seen = generation;
+          current = job;
+        }
+        work(id, *current);
+        {
+          std::unique_lock<std::mutex> guard(mutex);
+          pending--;
+          if(pending == 0)
+            finished.notify_one();
+        }
+      }
+    }
+
+    void work(int id, const std::function<void(int)>& task)
+    {
+      int index;
+      while(popTask(id, index) || stealTask(id, index))
+        task(index);
+    }
+
+    bool popTask(int id, int& index)
+    {
+      std::unique_lock<std::mutex> guard(queues[id]->lock);
+      if(queues[id]->tasks.empty())
+        return false;
+      index = queues[id]->tasks.front();
+      queues[id]->tasks.pop_front();
+      return true;
+    }
+
+    bool stealTask(int id, int& index)
+    {
+      int threads = queues.size();
+      for(int i = 1; i < threads; i++) {
+        WorkQueue* victim = queues[(id + i) % threads];
+        std::unique_lock<std::mutex> guard(victim->lock);
+        if(!victim->tasks.empty()) {
+          index = victim->tasks.back();
+          victim->tasks.pop_back();
+          return true;
+        }
+      }
+      return false;
+    }
+};
@@ -0,0 +1,96 @@
+#pragma once
+#include <glm/glm.hpp>
+#include <vector>
+#include "ModelTriangle.h"
+
+// Zeroed slots past the last one, so SIMD kernels can load a full vector
+// from any slot. Zero edges make them parallel to every ray, so they never hit.
+#define STORE_PADDING 8
+
+// Structure-of-arrays copy of the triangle data the intersection kernels
+// read: the first vertex, both edges and the material. Slots follow the
+// order they were built in (the BVH leaf order), triangleIndex maps a slot
+// back to its ModelTriangle.
+class TriangleStore
+{
+  public:
+    std::vector<float> v0x, v0y, v0z;
+    std::vector<float> e0x, e0y, e0z;
+    std::vector<float> e1x, e1y, e1z;
+    std::vector<int> materialIndex;
+    std::vector<int> triangleIndex;
+
+    TriangleStore()
+    {
+    }
+
+    void build(const std::vector<ModelTriangle>& triangles, const std::vector<int>& order, const std::vector<int>& materials)
+    {
+      int count = order.size();
+      v0x.resize(count); v0y.resize(count); v0z.resize(count);
+      e0x.resize(count); e0y.resize(count); e0z.resize(count);
+      e1x.resize(count); e1y.resize(count); e1z.resize(count);
+      for(std::vector<float>* padded : {&v0x, &v0y, &v0z, &e0x, &e0y, &e0z, &e1x, &e1y, &e1z})
+        padded->resize(count + STORE_PADDING, 0);
+      materialIndex.resize(count);
+      triangleIndex.resize(count);
+      for(int slot = 0; slot < count; slot++) {
+        const ModelTriangle& triangle = triangles[order[slot]];
+        glm::vec3 e0 = triangle.vertices[1] - triangle.vertices[0];
+        glm::vec3 e1 = triangle.vertices[2] - triangle.vertices[0];
+        v0x[slot] = triangle.vertices[0].x;
+        v0y[slot] = triangle.vertices[0].y;
+        v0z[slot] = triangle.vertices[0].z;
+        e0x[slot] = e0.x;
+        e0y[slot] = e0.y;
+        e0z[slot] = e0.z;
+        e1x[slot] = e1.x;
+        e1y[slot] = e1.y;
+        e1z[slot] = e1.z;
+        materialIndex[slot] = materials[order[slot]];
+        triangleIndex[slot] = order[slot];
+      }
+    }
+
+    int size() const
+    {
+      return triangleIndex.size();
+    }
+
+    glm::vec3 vertex0(int slot) const
+    {
+      return glm::vec3(v0x[slot], v0y[slot], v0z[slot]);
+    }
+
+    glm::vec3 edge0(int slot) const
+    {
+      return glm::vec3(e0x[slot], e0y[slot], e0z[slot]);
+    }
+
+    glm::vec3 edge1(int slot) const
+    {
+      return glm::vec3(e1x[slot], e1y[slot], e1z[slot]);
+    }
+
+    // Moller-Trumbore test of one slot, true for a hit in [minDist, tMax)
+    bool intersect(int slot, const glm::vec3& origin, const glm::vec3& dir, float minDist, float tMax, float& t, float& u, float& v) const
+    {
+      glm::vec3 e0 = edge0(slot);
+      glm::vec3 e1 = edge1(slot);
+      glm::vec3 pvec = glm::cross(dir, e1);
+      float det = glm::dot(e0, pvec);
+      if(det > -1e-8f && det < 1e-8f)
+        return false;
+      float invDet = 1.0f / det;
+      glm::vec3 tvec = origin - vertex0(slot);
+      u = glm::dot(tvec, pvec) * invDet;
+      if(u < 0 || u > 1)
+        return false;
+      glm::vec3 qvec = glm::cross(tvec, e0);
+      v = glm::dot(dir, qvec) * invDet;
+      if(v < 0 || u + v > 1)
+        return false;
+      t = glm::dot(e1, qvec) * invDet;
+      return t >= minDist && t < tMax;
+    }
+};
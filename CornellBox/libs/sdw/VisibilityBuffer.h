@@ -0,0 +1,107 @@
+#pragma once
+#include <glm/glm.hpp>
+#include <vector>
+#include <limits>
+#include <cmath>
+#include <algorithm>
+
+#define VISIBILITY_NEAR_PLANE 0.01f
+
+// Which triangle the camera sees at every pixel, found by rasterising the
+// scene instead of tracing camera rays. Triangles are given in camera space,
+// looking down -z, and pixel (x, y) is covered where the camera ray of the ray
+// tracer through (x, y) would pass, so the two agree on what every pixel shows.
+// Buffers are flat arrays indexed x * height + y like the screen.
+class VisibilityBuffer
+{
+  public:
+    std::vector<float> depth;
+    std::vector<int> instance;
+    std::vector<int> slot;
+
+    VisibilityBuffer(int bufferWidth, int bufferHeight, float focal)
+    {
+      width = bufferWidth;
+      height = bufferHeight;
+      focalLength = focal;
+      depth.resize(width * height);
+      instance.resize(width * height);
+      slot.resize(width * height);
+      clear();
+    }
+
+    void clear()
+    {
+      std::fill(depth.begin(), depth.end(), std::numeric_limits<float>::infinity());
+      std::fill(instance.begin(), instance.end(), -1);
+      std::fill(slot.begin(), slot.end(), -1);
+    }
+
+    // Rasterise a camera space triangle, keeping its ids where it is the nearest
+    void drawTriangle(const glm::vec3* vertices, int triangleInstance, int triangleSlot)
+    {
+      //Clip against the near plane, nothing behind the camera can be projected
+      glm::vec3 clipped[4];
+      int count = 0;
+      for(int k = 0; k < 3; k++) {
+        const glm::vec3& a = vertices[k];
+        const glm::vec3& b = vertices[(k + 1) % 3];
+        bool aInside = a.z <= -VISIBILITY_NEAR_PLANE;
+        bool bInside = b.z <= -VISIBILITY_NEAR_PLANE;
+        if(aInside)
+          clipped[count++] = a;
+        if(aInside != bInside)
+          clipped[count++] = a + (b - a) * ((-VISIBILITY_NEAR_PLANE - a.z) / (b.z - a.z));
+      }
+      for(int k = 1; k + 1 < count; k++)
+        drawClipped(clipped[0], clipped[k], clipped[k + 1], triangleInstance, triangleSlot);
+    }
+
+  private:
+    int width;
+    int height;
+    float focalLength;
+
+    static float edge(const glm::vec2& a, const glm::vec2& b, const glm::vec2& point)
+    {
+      return (b.x - a.x) * (point.y - a.y) - (b.y - a.y) * (point.x - a.x);
+    }
+
+    // Cover the pixels inside the projected triangle, depth is the distance along -z
+    void drawClipped(const glm::vec3& c0, const glm::vec3& c1, const glm::vec3& c2, int triangleInstance, int triangleSlot)
+    {
+      const glm::vec3* corners[3] = {&c0, &c1, &c2};
+      glm::vec2 projected[3];
+      float inverseZ[3];
+      for(int k = 0; k < 3; k++) {
+        projected[k] = glm::vec2(corners[k]->x * focalLength / corners[k]->z + width / 2, corners[k]->y * focalLength / corners[k]->z + height / 2);
+        inverseZ[k] = 1 / corners[k]->z;
+      }
+      float area = edge(projected[0], projected[1], projected[2]);
+      //CASE: Triangle seen edge on
+      if(area == 0)
+        return;
+      int xMin = std::max(0, (int) std::ceil(std::min(projected[0].x, std::min(projected[1].x, projected[2].x))));
+      int xMax = std::min(width - 1, (int) std::floor(std::max(projected[0].x, std::max(projected[1].x, projected[2].x))));
+      int yMin = std::max(0, (int) std::ceil(std::min(projected[0].y, std::min(projected[1].y, projected[2].y))));
+      int yMax = std::min(height - 1, (int) std::floor(std::max(projected[0].y, std::max(projected[1].y, projected[2].y))));
+      float inverseArea = 1 / area;
+      for(int x = xMin; x <= xMax; x++)
+        for(int y = yMin; y <= yMax; y++) {
+          glm::vec2 point(x, y);
+          float w0 = edge(projected[1], projected[2], point) * inverseArea;
+          float w1 = edge(projected[2], projected[0], point) * inverseArea;
+          float w2 = edge(projected[0], projected[1], point) * inverseArea;
+          //CASE: Pixel outside the triangle
+          if(w0 < 0 || w1 < 0 || w2 < 0)
+            continue;
+          float distance = -1 / (w0 * inverseZ[0] + w1 * inverseZ[1] + w2 * inverseZ[2]);
+          int pixel = x * height + y;
+          if(distance < depth[pixel]) {
+            depth[pixel] = distance;
+            instance[pixel] = triangleInstance;
+            slot[pixel] = triangleSlot;
+          }
+        }
+    }
+};
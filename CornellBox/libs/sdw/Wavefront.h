@@ -0,0 +1,25 @@
+#pragma once
+#include <glm/glm.hpp>
+
+// Shadow ray towards one light sample, with the colour the surface gets
+// when the light is visible and when it is blocked
+class ShadowRay
+{
+  public:
+    glm::vec3 origin;
+    glm::vec3 direction;
+    float maxDistance;
+    glm::vec3 lit;
+    glm::vec3 shadowed;
+};
+
+// A path that ended on a diffuse surface: its pixel waits for the shadow
+// rays firstShadow ... firstShadow + shadowCount - 1
+class ShadedHit
+{
+  public:
+    int pixel;
+    int glassBounces;
+    int firstShadow;
+    int shadowCount;
+};
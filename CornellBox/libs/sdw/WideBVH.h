@@ -0,0 +1,287 @@
+#pragma once
+#include <glm/glm.hpp>
+#include <vector>
+#include <limits>
+#include "BVH.h"
+#include "RayPacket.h"
+#include "TriangleStore.h"
+
+// Up to PACKET_SIZE children per node, wider than that nodes never get
+#define WIDE_BVH_WIDTH PACKET_SIZE
+#define WIDE_BVH_STACK_SIZE (BVH_STACK_SIZE * WIDE_BVH_WIDTH)
+
+// Children of a wide node with their bounds lane by lane, so one slab test of
+// a single ray covers all of them. A child with count > 0 is a leaf over
+// primitiveIndices [child, child + count) of the BVH it was collapsed from,
+// otherwise child is the index of another wide node.
+class WideBVHNode
+{
+  public:
+    float minX[WIDE_BVH_WIDTH], minY[WIDE_BVH_WIDTH], minZ[WIDE_BVH_WIDTH];
+    float maxX[WIDE_BVH_WIDTH], maxY[WIDE_BVH_WIDTH], maxZ[WIDE_BVH_WIDTH];
+    int child[WIDE_BVH_WIDTH];
+    int count[WIDE_BVH_WIDTH];
+    // Bit per lane that holds a child
+    int used;
+
+    WideBVHNode()
+    {
+      for(int i = 0; i < WIDE_BVH_WIDTH; i++) {
+        minX[i] = minY[i] = minZ[i] = 0;
+        maxX[i] = maxY[i] = maxZ[i] = 0;
+        child[i] = 0;
+        count[i] = 0;
+      }
+      used = 0;
+    }
+};
+
+// A binary BVH collapsed into nodes of PACKET_SIZE children. The leaves stay
+// the same, so visitors get the same primitive ranges as with the binary tree,
+// but a ray loads and tests a few wide nodes instead of many narrow ones.
+class WideBVH
+{
+  public:
+    std::vector<WideBVHNode> nodes;
+
+    WideBVH()
+    {
+    }
+
+    // Collapse binary, which has to be rebuilt into this after every build or refit
+    void build(const BVH& binary)
+    {
+      nodes.clear();
+      if(binary.nodes.empty())
+        return;
+      nodes.reserve(binary.nodes.size() / 2 + 1);
+      nodes.push_back(WideBVHNode());
+      collapse(binary, 0, 0);
+    }
+
+    // Visit the leaves a ray reaches, nearest first, like BVH::traverseClosest
+    template<typename Visitor>
+    void traverseClosest(const glm::vec3& origin, const glm::vec3& dir, const float& tMax, Visitor visitLeaf) const
+    {
+      if(nodes.empty())
+        return;
+      WideRay ray(origin, dir);
+      int stackChild[WIDE_BVH_STACK_SIZE];
+      int stackCount[WIDE_BVH_STACK_SIZE];
+      float stackDist[WIDE_BVH_STACK_SIZE];
+      int stackSize = 0;
+      stackChild[stackSize] = 0;
+      stackCount[stackSize] = 0;
+      stackDist[stackSize++] = 0;
+
+      while(stackSize > 0) {
+        stackSize--;
+        if(stackDist[stackSize] > tMax)
+          continue;
+        //CASE: Leaf
+        if(stackCount[stackSize] > 0) {
+          visitLeaf(stackChild[stackSize], stackCount[stackSize]);
+          continue;
+        }
+        const WideBVHNode& node = nodes[stackChild[stackSize]];
+        float dist[WIDE_BVH_WIDTH];
+        int hits = intersectChildren(node, ray, tMax, dist);
+        //Push the children far to near so the nearest is popped first
+        int order[WIDE_BVH_WIDTH];
+        int hitCount = 0;
+        for(; hits != 0; hits &= hits - 1) {
+          int lane = lowestLane(hits);
+          int i = hitCount++;
+          for(; i > 0 && dist[order[i - 1]] < dist[lane]; i--)
+            order[i] = order[i - 1];
+          order[i] = lane;
+        }
+        for(int i = 0; i < hitCount; i++) {
+          stackChild[stackSize] = node.child[order[i]];
+          stackCount[stackSize] = node.count[order[i]];
+          stackDist[stackSize++] = dist[order[i]];
+        }
+      }
+    }
+
+    // Visit the leaves a ray reaches in any order until one returns true, like BVH::traverseAny
+    template<typename Visitor>
+    bool traverseAny(const glm::vec3& origin, const glm::vec3& dir, float tMax, Visitor visitLeaf) const
+    {
+      if(nodes.empty())
+        return false;
+      WideRay ray(origin, dir);
+      int stack[WIDE_BVH_STACK_SIZE];
+      int stackSize = 0;
+      stack[stackSize++] = 0;
+      while(stackSize > 0) {
+        const WideBVHNode& node = nodes[stack[--stackSize]];
+        float dist[WIDE_BVH_WIDTH];
+        for(int hits = intersectChildren(node, ray, tMax, dist); hits != 0; hits &= hits - 1) {
+          int lane = lowestLane(hits);
+          if(node.count[lane] == 0)
+            stack[stackSize++] = node.child[lane];
+          else if(visitLeaf(node.child[lane], node.count[lane]))
+            return true;
+        }
+      }
+      return false;
+    }
+
+  private:
+    // One ray broadcast to every lane
+    class WideRay
+    {
+      public:
+        PacketFloat originX, originY, originZ;
+        PacketFloat invDirX, invDirY, invDirZ;
+
+        WideRay(const glm::vec3& origin, const glm::vec3& dir)
+        {
+          glm::vec3 invDir = 1.0f / dir;
+          originX = packetSet(origin.x);
+          originY = packetSet(origin.y);
+          originZ = packetSet(origin.z);
+          invDirX = packetSet(invDir.x);
+          invDirY = packetSet(invDir.y);
+          invDirZ = packetSet(invDir.z);
+        }
+    };
+
+    static int lowestLane(int mask)
+    {
+      int lane = 0;
+      while(!(mask & (1 << lane)))
+        lane++;
+      return lane;
+    }
+
+    // Slab test against every child at once. Returns a bit per child entered
+    // before tMax, with the entry distances (clamped to 0) in dist.
+    static int intersectChildren(const WideBVHNode& node, const WideRay& ray, float tMax, float* dist)
+    {
+      PacketFloat t0 = packetMul(packetSub(packetLoad(node.minX), ray.originX), ray.invDirX);
+      PacketFloat t1 = packetMul(packetSub(packetLoad(node.maxX), ray.originX), ray.invDirX);
+      PacketFloat tEnter = packetMax(packetSet(0), packetMin(t0, t1));
+      PacketFloat tExit = packetMin(packetSet(tMax), packetMax(t0, t1));
+      t0 = packetMul(packetSub(packetLoad(node.minY), ray.originY), ray.invDirY);
+      t1 = packetMul(packetSub(packetLoad(node.maxY), ray.originY), ray.invDirY);
+      tEnter = packetMax(tEnter, packetMin(t0, t1));
+      tExit = packetMin(tExit, packetMax(t0, t1));
+      t0 = packetMul(packetSub(packetLoad(node.minZ), ray.originZ), ray.invDirZ);
+      t1 = packetMul(packetSub(packetLoad(node.maxZ), ray.originZ), ray.invDirZ);
+      tEnter = packetMax(tEnter, packetMin(t0, t1));
+      tExit = packetMin(tExit, packetMax(t0, t1));
+      packetStore(dist, tEnter);
+      return packetMask(packetGreaterEqual(tExit, tEnter)) & node.used;
+    }
+
+    // Fill wide node wideIndex from binary node binaryIndex: its children are
+    // opened, largest first, until the node is full or only leaves are left
+    void collapse(const BVH& binary, int binaryIndex, int wideIndex)
+    {
+      int children[WIDE_BVH_WIDTH];
+      int childCount = 0;
+      if(binary.nodes[binaryIndex].isLeaf()) {
+        children[childCount++] = binaryIndex;
+      }
+      else {
+        children[childCount++] = binary.nodes[binaryIndex].leftFirst;
+        children[childCount++] = binary.nodes[binaryIndex].leftFirst + 1;
+      }
+      while(childCount < WIDE_BVH_WIDTH) {
+        int largest = -1;
+        float largestArea = -1;
+        for(int i = 0; i < childCount; i++) {
+          const BVHNode& candidate = binary.nodes[children[i]];
+          if(!candidate.isLeaf() && candidate.bounds.area() > largestArea) {
+            largest = i;
+            largestArea = candidate.bounds.area();
+          }
+        }
+        //CASE: Only leaves left
+        if(largest < 0)
+          break;
+        int opened = binary.nodes[children[largest]].leftFirst;
+        children[largest] = opened;
+        children[childCount++] = opened + 1;
+      }
+
+      for(int i = 0; i < childCount; i++) {
+        const BVHNode& binaryChild = binary.nodes[children[i]];
+        int child = binaryChild.leftFirst;
+        //Interior children get a wide node of their own, which may move the nodes
+        if(!binaryChild.isLeaf()) {
+          child = nodes.size();
+          nodes.push_back(WideBVHNode());
+          collapse(binary, children[i], child);
+        }
+        WideBVHNode& node = nodes[wideIndex];
+        node.minX[i] = binaryChild.bounds.min.x;
+        node.minY[i] = binaryChild.bounds.min.y;
+        node.minZ[i] = binaryChild.bounds.min.z;
+        node.maxX[i] = binaryChild.bounds.max.x;
+        node.maxY[i] = binaryChild.bounds.max.y;
+        node.maxZ[i] = binaryChild.bounds.max.z;
+        node.child[i] = child;
+        node.count[i] = binaryChild.count;
+        node.used |= 1 << i;
+      }
+    }
+};
+
+// Closest hit of one ray among store slots [first, first + count), tested
+// PACKET_SIZE triangles at a time with the same Moller-Trumbore steps as
+// TriangleStore::intersect. Relies on the store padding past its last slot.
+inline bool intersectStoreSlots(const TriangleStore& store, int first, int count, const glm::vec3& origin, const glm::vec3& dir, float minDist, float tMax, float& t, float& u, float& v, int& slot)
+{
+  static const float lanes[8] = {0, 1, 2, 3, 4, 5, 6, 7};
+  PacketFloat dx = packetSet(dir.x), dy = packetSet(dir.y), dz = packetSet(dir.z);
+  PacketFloat zero = packetSet(0), one = packetSet(1);
+  bool found = false;
+  for(int base = first; base < first + count; base += PACKET_SIZE) {
+    PacketFloat e0x = packetLoad(&store.e0x[base]), e0y = packetLoad(&store.e0y[base]), e0z = packetLoad(&store.e0z[base]);
+    PacketFloat e1x = packetLoad(&store.e1x[base]), e1y = packetLoad(&store.e1y[base]), e1z = packetLoad(&store.e1z[base]);
+    //pvec = dir x e1
+    PacketFloat px = packetSub(packetMul(dy, e1z), packetMul(e1y, dz));
+    PacketFloat py = packetSub(packetMul(dz, e1x), packetMul(e1z, dx));
+    PacketFloat pz = packetSub(packetMul(dx, e1y), packetMul(e1x, dy));
+    PacketFloat det = packetAdd(packetAdd(packetMul(e0x, px), packetMul(e0y, py)), packetMul(e0z, pz));
+    //Lanes past the end of the range and parallel triangles are out
+    PacketFloat valid = packetAnd(packetLess(packetLoad(lanes), packetSet((float) (first + count - base))),
+                                  packetGreaterEqual(packetAbs(det), packetSet(1e-8f)));
+    PacketFloat invDet = packetDiv(one, det);
+    PacketFloat tx = packetSub(packetSet(origin.x), packetLoad(&store.v0x[base]));
+    PacketFloat ty = packetSub(packetSet(origin.y), packetLoad(&store.v0y[base]));
+    PacketFloat tz = packetSub(packetSet(origin.z), packetLoad(&store.v0z[base]));
+    PacketFloat laneU = packetMul(packetAdd(packetAdd(packetMul(tx, px), packetMul(ty, py)), packetMul(tz, pz)), invDet);
+    valid = packetAnd(valid, packetAnd(packetGreaterEqual(laneU, zero), packetGreaterEqual(one, laneU)));
+    if(packetMask(valid) == 0)
+      continue;
+    //qvec = tvec x e0
+    PacketFloat qx = packetSub(packetMul(ty, e0z), packetMul(e0y, tz));
+    PacketFloat qy = packetSub(packetMul(tz, e0x), packetMul(e0z, tx));
+    PacketFloat qz = packetSub(packetMul(tx, e0y), packetMul(e0x, ty));
+    PacketFloat laneV = packetMul(packetAdd(packetAdd(packetMul(dx, qx), packetMul(dy, qy)), packetMul(dz, qz)), invDet);
+    PacketFloat laneT = packetMul(packetAdd(packetAdd(packetMul(e1x, qx), packetMul(e1y, qy)), packetMul(e1z, qz)), invDet);
+    valid = packetAnd(valid, packetAnd(packetGreaterEqual(laneV, zero), packetGreaterEqual(one, packetAdd(laneU, laneV))));
+    valid = packetAnd(valid, packetAnd(packetGreaterEqual(laneT, packetSet(minDist)), packetLess(laneT, packetSet(tMax))));
+    int hits = packetMask(valid);
+    if(hits == 0)
+      continue;
+    float ts[PACKET_SIZE], us[PACKET_SIZE], vs[PACKET_SIZE];
+    packetStore(ts, laneT);
+    packetStore(us, laneU);
+    packetStore(vs, laneV);
+    for(int lane = 0; lane < PACKET_SIZE; lane++)
+      if((hits & (1 << lane)) && ts[lane] < tMax) {
+        tMax = ts[lane];
+        t = ts[lane];
+        u = us[lane];
+        v = vs[lane];
+        slot = base + lane;
+        found = true;
+      }
+  }
+  return found;
+}